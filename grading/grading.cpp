@@ -24,9 +24,11 @@
 // External headers
 #include <algorithm>
 #include <atomic>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <random>
+#include <sys/resource.h>
 #include <variant>
 
 // Internal headers
@@ -307,6 +309,8 @@ int main(int argc, char** argv) {
     }
     // Get/set/compute run parameters
     auto const nbworkers = []() {
+      if (auto env = ::std::getenv("NBWORKERS"); env && *env) // Override
+        return static_cast<size_t>(::std::stoul(env));
       auto res = ::std::thread::hardware_concurrency();
       if (unlikely(res == 0))
         res = 16;
@@ -390,8 +394,14 @@ int main(int argc, char** argv) {
           ::std::cout << " -> " << (reference / perfdbl) << " speedup";
         }
         ::std::cout << ::std::endl;
-        ::std::cout << "⎩ Average TX execution time: " << (perfdbl / pertxdiv)
+        ::std::cout << "⎪ Average TX execution time: " << (perfdbl / pertxdiv)
                     << " ns" << ::std::endl;
+        // High-water mark of the whole process, so it only grows from one
+        // library to the next
+        ::rusage usage;
+        ::getrusage(RUSAGE_SELF, &usage);
+        ::std::cout << "⎩ Peak resident memory:      " << usage.ru_maxrss
+                    << " KiB" << ::std::endl;
       } catch (::std::exception const&
                    err) { // Special case: cannot unload library with running
                           // threads, so print error and quick-exit
@@ -27,12 +27,41 @@
 extern "C" {
 #include <dlfcn.h>
 #include <limits.h>
+#include <string.h>
 }
 
 // Internal headers
+#if defined(TM_STATIC) || defined(TM_INLINE)
+// The engine compiled in declares tm.hpp's names globally: share those, rather than declare a second Alloc
+#include <tm.hpp>
+namespace STM {
+using ::shared_t;
+using ::tx_t;
+using ::Alloc;
+using ::invalid_shared;
+using ::invalid_tx;
+using ::tm_create;
+using ::tm_destroy;
+using ::tm_start;
+using ::tm_size;
+using ::tm_align;
+using ::tm_begin;
+using ::tm_end;
+using ::tm_read;
+using ::tm_write;
+using ::tm_alloc;
+using ::tm_free;
+}
+#else
 namespace STM {
 #include <tm.hpp>
 }
+#endif
+#ifdef TM_INLINE
+#include <memory>
+#include <optional>
+#include <tm-inline.hpp>
+#endif
 #include "common.hpp"
 
 // -------------------------------------------------------------------------- //
@@ -93,6 +122,9 @@ private:
     FnWrite   tm_write;   // Module's shared memory write function
     FnAlloc   tm_alloc;   // Module's shared memory allocation function
     FnFree    tm_free;    // Module's shared memory freeing function
+#ifdef TM_INLINE
+    bool inline_engine = false; // Engine compiled in, called through tm-inline.hpp instead
+#endif
 private:
     /** Solve a symbol from its name, and bind it to the given function.
      * @param name Name of the symbol to resolve
@@ -112,6 +144,30 @@ public:
      * @param path  Path to the library to load
     **/
     TransactionalLibrary(char const* path) {
+#ifdef TM_INLINE
+        if (::std::strcmp(path, "inline") == 0) { // Engine compiled into this binary, along with tm-inline.hpp
+            module = nullptr;
+            inline_engine = true;
+            return;
+        }
+#endif
+#ifdef TM_STATIC
+        if (::std::strcmp(path, "static") == 0) { // Engine linked into this binary
+            module = nullptr;
+            tm_create  = &STM::tm_create;
+            tm_destroy = &STM::tm_destroy;
+            tm_start   = &STM::tm_start;
+            tm_size    = &STM::tm_size;
+            tm_align   = &STM::tm_align;
+            tm_begin   = &STM::tm_begin;
+            tm_end     = &STM::tm_end;
+            tm_read    = &STM::tm_read;
+            tm_write   = &STM::tm_write;
+            tm_alloc   = &STM::tm_alloc;
+            tm_free    = &STM::tm_free;
+            return;
+        }
+#endif
         { // Resolve path and load module
             char resolved[PATH_MAX];
             if (unlikely(!realpath(path, resolved)))
@@ -163,6 +219,9 @@ private:
     void*  start_addr; // Shared memory region first segment's start address
     size_t start_size; // Shared memory region first segment's size (in bytes)
     size_t alignment;  // Shared memory region alignment (in bytes)
+#ifdef TM_INLINE
+    ::std::unique_ptr<stm::Shared> engine; // Region, if the library is the engine compiled in
+#endif
 public:
     /** Bind constructor.
      * @param library Transactional library to use
@@ -173,6 +232,13 @@ public:
         if (unlikely(assert_mode && (!is_power_of_two(align) || size % align != 0)))
             throw Exception::TransactionAlign{};
         bounded_run(max_side_time, [&]() {
+#ifdef TM_INLINE
+            if (tl.inline_engine) {
+                engine = ::std::make_unique<stm::Shared>(size, align);
+                start_addr = engine->start();
+                return;
+            }
+#endif
             shared = tl.tm_create(size, align);
             if (unlikely(shared == STM::invalid_shared))
                 throw Exception::TransactionCreate{};
@@ -183,6 +249,12 @@ public:
     **/
     ~TransactionalMemory() noexcept {
         bounded_run(max_side_time, [&]() {
+#ifdef TM_INLINE
+            if (engine) {
+                engine.reset();
+                return;
+            }
+#endif
             tl.tm_destroy(shared);
         }, "The transactional library takes too long destroying the shared memory");
     }
@@ -205,6 +277,14 @@ public:
     auto get_align() const noexcept {
         return alignment;
     }
+#ifdef TM_INLINE
+    /** [thread-safe] Return the engine compiled in behind the region, if that's the library.
+     * @return Engine's region, null if the library was loaded
+    **/
+    auto get_engine() const noexcept {
+        return engine.get();
+    }
+#endif
 public:
     /** [thread-safe] Begin a new transaction on the shared memory region.
      * @param ro Whether the transaction is read-only
@@ -274,6 +354,9 @@ private:
     STM::tx_t tx; // Opaque transaction handle
     bool aborted; // Transaction was aborted
     bool is_ro;   // Whether the transaction is read-only (solely for assertion)
+#ifdef TM_INLINE
+    ::std::optional<stm::Transaction> engine_tx; // Transaction, if the library is the engine compiled in
+#endif
 public:
     /** Deleted copy constructor/assignment.
     **/
@@ -287,14 +370,51 @@ public:
         if (unlikely(tx == STM::invalid_tx))
             throw Exception::TransactionBegin{};
     }
+#ifdef TM_INLINE
+    /** Begin constructor, for either kind of library.
+     * @param tm   Transactional memory to bind
+     * @param ro   Whether the transaction is read-only
+     * @param site Call site the engine compiled in tells transactions apart by
+    **/
+    Transaction(TransactionalMemory const& tm, Mode ro, stm::CallSite site): tm{tm}, tx{STM::invalid_tx}, aborted{false}, is_ro{static_cast<bool>(ro)} {
+        if (tm.get_engine()) {
+            engine_tx.emplace(*tm.get_engine(), is_ro, site);
+            return;
+        }
+        tx = tm.begin(is_ro);
+        if (unlikely(tx == STM::invalid_tx))
+            throw Exception::TransactionBegin{};
+    }
+#endif
     /** End destructor.
     **/
     ~Transaction() noexcept(false) {
         if (likely(!aborted)) {
+#ifdef TM_INLINE
+            if (engine_tx) {
+                if (unlikely(!engine_tx->commit()))
+                    throw Exception::TransactionRetry{};
+                return;
+            }
+#endif
             if (unlikely(!tm.end(tx)))
                 throw Exception::TransactionRetry{};
         }
     }
+private:
+    /** Whether the operation of the bound transaction succeeded, on either kind of library.
+     * @param engine Operation on the engine compiled in
+     * @param loaded Operation through the loaded library
+    **/
+    template<class Engine, class Loaded> bool succeeded(Engine&& engine, Loaded&& loaded) {
+#ifdef TM_INLINE
+        if (engine_tx)
+            return engine(*engine_tx);
+#else
+        (void) engine;
+#endif
+        return loaded();
+    }
 public:
     /** [thread-safe] Return the bound transactional memory instance.
      * @return Bound transactional memory instance
@@ -309,7 +429,7 @@ public:
      * @param target Target start address
     **/
     void read(void const* source, size_t size, void* target) {
-        if (unlikely(!tm.read(tx, source, size, target))) {
+        if (unlikely(!succeeded([&](auto& etx) { return etx.read(source, size, target); }, [&]() { return tm.read(tx, source, size, target); }))) {
             aborted = true;
             throw Exception::TransactionRetry{};
         }
@@ -322,7 +442,7 @@ public:
     void write(void const* source, size_t size, void* target) {
         if (unlikely(assert_mode && is_ro))
             throw Exception::TransactionReadOnly{};
-        if (unlikely(!tm.write(tx, source, size, target))) {
+        if (unlikely(!succeeded([&](auto& etx) { return etx.write(source, size, target); }, [&]() { return tm.write(tx, source, size, target); }))) {
             aborted = true;
             throw Exception::TransactionRetry{};
         }
@@ -335,7 +455,9 @@ public:
         if (unlikely(assert_mode && is_ro))
             throw Exception::TransactionReadOnly{};
         void* target;
-        switch (tm.alloc(tx, size, &target)) {
+        auto status = STM::Alloc::abort;
+        succeeded([&](auto& etx) { status = etx.alloc(size, &target); return true; }, [&]() { status = tm.alloc(tx, size, &target); return true; });
+        switch (status) {
         case STM::Alloc::success:
             return target;
         case STM::Alloc::nomem:
@@ -351,7 +473,7 @@ public:
     void free(void* target) {
         if (unlikely(assert_mode && is_ro))
             throw Exception::TransactionReadOnly{};
-        if (unlikely(!tm.free(tx, target))) {
+        if (unlikely(!succeeded([&](auto& etx) { return etx.free(target); }, [&]() { return tm.free(tx, target); }))) {
             aborted = true;
             throw Exception::TransactionRetry{};
         }
@@ -611,7 +733,12 @@ public:
 template<class Func> static auto transactional(TransactionalMemory const& tm, Transaction::Mode mode, Func&& func) {
     do {
         try {
+#ifdef TM_INLINE
+            static char const site = 0; // One call site per transaction body, see tm_begin_at
+            Transaction tx{tm, mode, stm::CallSite{&site}};
+#else
             Transaction tx{tm, mode};
+#endif
             return func(tx);
         } catch (Exception::TransactionRetry const&) {
             continue;
@@ -16,9 +16,24 @@ public:
   void remove(const Key& ptr) { ranges.erase(ptr); }
   void merge(RegionTree&& other) { ranges.merge(std::move(other.ranges)); }
 
+  // Range containing `ptr`, or end() if there is none
   iterator find(void* ptr) {
+    auto key = reinterpret_cast<Key>(ptr);
+    auto it = ranges.upper_bound(key);
+    if (it == ranges.begin()) {
+      return ranges.end();
+    }
+    --it;
+    auto start = reinterpret_cast<std::uintptr_t>(it->first);
+    if (reinterpret_cast<std::uintptr_t>(ptr) - start < it->second) {
+      return it;
+    }
+    return ranges.end();
   }
 
+  iterator begin() { return ranges.begin(); }
+  iterator end() { return ranges.end(); }
+
 private:
   std::map<Key, std::size_t> ranges;
 };
@@ -0,0 +1,325 @@
+#pragma once
+
+// C++20 coroutine front end to the C interface of tm.hpp: a Scheduler runs
+// many transactions as coroutines on one thread. When a transaction aborts,
+// its coroutine is parked instead of retrying at once, and the scheduler
+// runs the others. One that aborted on a busy lock is retried once the lock
+// is released, any other after the next commit from this scheduler; either
+// way at the latest once a randomized, exponentially growing backoff
+// expires.
+//
+// Transactions begin with tm_begin_suspendable, so the engine never blocks
+// the thread on their behalf: they abort at once on a busy lock, and never
+// wait to begin (TM_SCHEDULE and coarse mode don't apply to them). A
+// transaction may co_await in its body, other ones on the same thread then
+// run in between. tm_atomic_* give up on the locks a suspended one holds
+// with eager versioning, rather than wait for them.
+
+#if __cplusplus >= 202002L
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "tm-ext.hpp"
+
+namespace stm::coro {
+
+template <typename T = void> class Task;
+
+namespace detail {
+
+// Hands control to whoever awaited the finished coroutine
+struct FinalAwaiter {
+  bool await_ready() const noexcept { return false; }
+  template <typename Promise>
+  std::coroutine_handle<>
+  await_suspend(std::coroutine_handle<Promise> self) const noexcept {
+    return self.promise().continuation;
+  }
+  void await_resume() const noexcept {}
+};
+
+struct PromiseBase {
+  // Resumed once this coroutine finished; roots go back to the scheduler
+  std::coroutine_handle<> continuation = std::noop_coroutine();
+
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+
+  void unhandled_exception() const noexcept { std::terminate(); }
+};
+
+template <typename T> struct Promise : PromiseBase {
+  std::optional<T> value;
+
+  void return_value(T result) { value.emplace(std::move(result)); }
+  T result() { return std::move(*value); }
+};
+
+template <> struct Promise<void> : PromiseBase {
+  void return_void() const noexcept {}
+  void result() const noexcept {}
+};
+
+} // namespace detail
+
+// A lazily started coroutine: runs when awaited, or when spawned on a
+// Scheduler
+template <typename T> class Task {
+public:
+  struct promise_type : detail::Promise<T> {
+    Task get_return_object() noexcept {
+      return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+  };
+
+  Task(Task&& other) noexcept
+      : handle(std::exchange(other.handle, nullptr)) {}
+  Task& operator=(Task&& other) noexcept {
+    std::swap(handle, other.handle);
+    return *this;
+  }
+  ~Task() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<>
+  await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    handle.promise().continuation = awaiting;
+    return handle;
+  }
+  T await_resume() { return handle.promise().result(); }
+
+  // Gives up ownership of the coroutine
+  [[nodiscard]] std::coroutine_handle<> release() noexcept {
+    return std::exchange(handle, nullptr);
+  }
+
+private:
+  explicit Task(std::coroutine_handle<promise_type> handle) noexcept
+      : handle(handle) {}
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+// Runs spawned tasks on the calling thread until they all finished
+class Scheduler {
+  using Clock = std::chrono::steady_clock;
+
+public:
+  // Longest a parked transaction waits for a commit to wake it
+  static constexpr auto MAX_BACKOFF = std::chrono::milliseconds(1);
+  // Parked transactions are polled for their lock every that many resumes,
+  // and whenever none is ready
+  static constexpr std::size_t POLL_EVERY = 64;
+
+  Scheduler() = default;
+  ~Scheduler() { reap(true); }
+
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  void spawn(Task<> task) {
+    auto handle = task.release();
+    tasks.push_back(handle);
+    ready.push_back(handle);
+    if (tasks.size() >= reap_at) {
+      reap(false);
+      reap_at = std::max<std::size_t>(64, 2 * tasks.size());
+    }
+  }
+
+  void run() {
+    std::size_t resumed = 0;
+    while (!ready.empty() || !parked.empty()) {
+      wake_expired();
+      if (ready.empty() || ++resumed % POLL_EVERY == 0) {
+        wake_released();
+      }
+      if (ready.empty()) {
+        // Other threads release the locks: let them run, unless only
+        // timers are left
+        if (watching == 0) {
+          std::this_thread::sleep_until(timers.top().deadline);
+        } else {
+          std::this_thread::yield();
+        }
+        continue;
+      }
+      auto next = ready.front();
+      ready.pop_front();
+      next.resume();
+    }
+    reap(false);
+  }
+
+  // Lets the other ready tasks run first
+  [[nodiscard]] auto yield() noexcept {
+    struct Yield {
+      Scheduler& scheduler;
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> self) const {
+        scheduler.ready.push_back(self);
+      }
+      void await_resume() const noexcept {}
+    };
+    return Yield{*this};
+  }
+
+  // Parks the caller after its `attempt`-th abort in a row, until the lock
+  // of `busy` in `shared` is released or, without one, a transaction
+  // commits; or else until the backoff expires
+  [[nodiscard]] auto backoff(unsigned attempt, shared_t shared = invalid_shared,
+                             void const* busy = nullptr) noexcept {
+    struct Backoff {
+      Scheduler& scheduler;
+      Clock::duration delay;
+      shared_t shared;
+      void const* busy;
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> self) const {
+        auto id = scheduler.next_id++;
+        scheduler.parked.emplace(id, Parked{self, shared, busy});
+        scheduler.watching += busy != nullptr;
+        scheduler.timers.push({Clock::now() + delay, id});
+      }
+      void await_resume() const noexcept {}
+    };
+    Clock::duration limit = MAX_BACKOFF;
+    if (attempt < 10) {
+      limit = std::min(limit, Clock::duration(std::chrono::microseconds(1)) *
+                                  (1u << attempt));
+    }
+    // Anywhere in [limit / 2, limit], so that aborted ones don't all come
+    // back at once
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return Backoff{*this,
+                   limit / 2 +
+                       Clock::duration(seed % (limit.count() / 2 + 1)),
+                   shared, busy};
+  }
+
+  // Wakes the parked transactions that don't wait for a lock: the commit
+  // may have been the one they conflicted with
+  void committed() {
+    std::erase_if(parked, [&](auto& entry) {
+      if (entry.second.busy != nullptr) {
+        return false;
+      }
+      ready.push_back(entry.second.handle);
+      return true;
+    });
+  }
+
+private:
+  struct Parked {
+    std::coroutine_handle<> handle;
+    shared_t shared;
+    void const* busy;
+  };
+
+  struct Timer {
+    Clock::time_point deadline;
+    std::uint64_t id;
+    bool operator>(const Timer& other) const noexcept {
+      return deadline > other.deadline;
+    }
+  };
+
+  void wake_expired() {
+    auto now = Clock::now();
+    while (!timers.empty()) {
+      auto& timer = timers.top();
+      auto it = parked.find(timer.id);
+      if (it != parked.end()) {
+        if (timer.deadline > now) {
+          break;
+        }
+        wake(it);
+      }
+      timers.pop();
+    }
+  }
+
+  void wake_released() {
+    if (watching == 0) {
+      return;
+    }
+    for (auto it = parked.begin(); it != parked.end();) {
+      auto& entry = it->second;
+      if (entry.busy != nullptr && !tm_locked(entry.shared, entry.busy)) {
+        it = wake(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  template <typename It> It wake(It it) {
+    watching -= it->second.busy != nullptr;
+    ready.push_back(it->second.handle);
+    return parked.erase(it);
+  }
+
+  // Frees the finished tasks, or all of them
+  void reap(bool all) {
+    std::erase_if(tasks, [&](auto handle) {
+      if (!all && !handle.done()) {
+        return false;
+      }
+      handle.destroy();
+      return true;
+    });
+  }
+
+  std::vector<std::coroutine_handle<>> tasks;
+  std::size_t reap_at = 64;
+  std::deque<std::coroutine_handle<>> ready;
+  std::unordered_map<std::uint64_t, Parked> parked;
+  // Parked transactions waiting for a lock
+  std::size_t watching = 0;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timers;
+  std::uint64_t next_id = 0;
+  std::uint64_t seed = 0x9e3779b97f4a7c15;
+};
+
+// Runs `body` as a transaction on `shared` until it commits. `body` takes the
+// transaction and returns a Task<bool>, false once an operation failed (the
+// transaction is then already rolled back).
+template <typename Body>
+Task<bool> atomically(Scheduler& scheduler, shared_t shared, bool is_ro,
+                      Body body) {
+  for (unsigned attempt = 0;; ++attempt) {
+    auto tx = tm_begin_suspendable(shared, is_ro);
+    if (tx == invalid_tx) {
+      co_return false;
+    }
+    if (co_await body(tx) && tm_end(shared, tx)) {
+      scheduler.committed();
+      co_return true;
+    }
+    // Right after the failed operation: no other transaction of this
+    // thread ended in between
+    co_await scheduler.backoff(attempt, shared, tm_conflict(shared));
+  }
+}
+
+} // namespace stm::coro
+
+#endif
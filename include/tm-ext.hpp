@@ -0,0 +1,67 @@
+/**
+ * @file   tm-ext.hpp
+ * @author Carlo Refice
+ *
+ * @section DESCRIPTION
+ *
+ * Extensions to the transaction manager interface of tm.hpp, exported by
+ * this library only.
+ **/
+
+#pragma once
+
+#include "tm.hpp"
+
+// -------------------------------------------------------------------------- //
+
+// One range of a batched access. For reads `buffer` is the private target,
+// for writes the private source.
+struct Access {
+  void* shared; // Start address in the shared region
+  size_t size;  // Positive multiple of the alignment
+  void* buffer;
+};
+
+// How tm_end_nested closed a closed nested scope
+enum class Scope : int {
+  committed, // Merged into the enclosing transaction
+  retry,     // Rolled back alone: the enclosing transaction goes on, and the
+             // scope may be run again
+  aborted    // The whole transaction was rolled back and its handle freed
+};
+
+// Priority class of a transaction, see tm_begin_priority
+enum class Priority : int {
+  low,    // Background work: deferred while high-priority transactions run,
+          // and gives up busy locks at once
+  normal, // Transactions from tm_begin
+  high    // Latency-sensitive: waits out busy locks rather than aborting
+};
+
+// Snapshot of a read-only transaction, which transactions on other threads
+// can read from too, see tm_export_snapshot
+typedef void* snapshot_t;
+constexpr static snapshot_t invalid_snapshot = nullptr;
+
+// -------------------------------------------------------------------------- //
+
+extern "C" {
+tx_t tm_begin_at(shared_t, bool, void const*) noexcept;
+tx_t tm_begin_si(shared_t) noexcept;
+tx_t tm_begin_priority(shared_t, bool, Priority, uint64_t) noexcept;
+tx_t tm_begin_suspendable(shared_t, bool) noexcept;
+void const* tm_conflict(shared_t) noexcept;
+bool tm_locked(shared_t, void const*) noexcept;
+snapshot_t tm_export_snapshot(shared_t, tx_t) noexcept;
+tx_t tm_begin_snapshot(shared_t, snapshot_t) noexcept;
+void tm_release_snapshot(shared_t, snapshot_t) noexcept;
+bool tm_read_many(shared_t, tx_t, Access const*, size_t) noexcept;
+bool tm_write_many(shared_t, tx_t, Access const*, size_t) noexcept;
+void const* tm_read_view(shared_t, tx_t, void const*, size_t) noexcept;
+bool tm_add(shared_t, tx_t, void*, int64_t, int64_t, int64_t) noexcept;
+void tm_atomic_load(shared_t, void const*, void*) noexcept;
+bool tm_atomic_store(shared_t, void const*, void*) noexcept;
+bool tm_atomic_cas(shared_t, void*, void*, void const*) noexcept;
+void tm_begin_nested(shared_t, tx_t) noexcept;
+Scope tm_end_nested(shared_t, tx_t) noexcept;
+}
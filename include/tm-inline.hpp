@@ -0,0 +1,273 @@
+#pragma once
+
+// Header-only C++ front end to the engine in src/, for programs that compile
+// the engine in rather than loading it as a library. Calls go straight to the
+// engine, without dlsym'd entry points or handle casts in between.
+//
+// Needs src/ on the include path and the engine's sources linked in. Only
+// this front end is header-only: the engine's accesses are defined and
+// explicitly instantiated in its own sources, so they inline into the caller
+// when those are compiled in the same translation unit (see `make
+// run-inline` in grading/), or else under -flto.
+
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "region.hpp"
+#include "tm-ext.hpp"
+#include "tm.hpp"
+
+namespace stm {
+
+// A shared memory region, destroyed with this object
+class Shared {
+public:
+  Shared(std::size_t size, std::size_t align)
+      : region(make_region(size, align, Config::from_env())) {}
+  ~Shared() { delete region; }
+
+  Shared(const Shared&) = delete;
+  Shared& operator=(const Shared&) = delete;
+
+  // Calls `func` with the engine behind the region
+  template <typename Func> decltype(auto) visit(Func&& func) {
+    return std::visit(std::forward<Func>(func), *region);
+  }
+
+  [[nodiscard]] void* start() {
+    return visit([](auto& mem) { return mem.start_addr(); });
+  }
+
+  [[nodiscard]] std::size_t size() {
+    return visit([](auto& mem) { return mem.size(); });
+  }
+
+  [[nodiscard]] std::size_t align() {
+    return visit([](auto& mem) { return mem.alignment(); });
+  }
+
+  // Single words, each one a transaction of its own; not to be called from
+  // within a transaction on this region
+  void load(const void* source, void* target) {
+    visit([&](auto& mem) { mem.atomic_load(source, target); });
+  }
+
+  bool store(const void* source, void* target) {
+    return visit([&](auto& mem) { return mem.atomic_store(source, target); });
+  }
+
+  bool compare_exchange(void* target, void* expected, const void* desired) {
+    return visit([&](auto& mem) {
+      return mem.atomic_cas(target, expected, desired);
+    });
+  }
+
+private:
+  ::Region* region;
+};
+
+// Where a transaction begins, as for tm_begin_at: the engine infers which
+// transactions are read-only per call site. Defaults to the caller's line.
+class CallSite {
+public:
+  CallSite(const char* file = __builtin_FILE(),
+           unsigned line = __builtin_LINE()) noexcept
+      : key(reinterpret_cast<std::uintptr_t>(file) + line) {}
+  // Any address unique to the call site
+  explicit CallSite(const void* site) noexcept
+      : key(reinterpret_cast<std::uintptr_t>(site)) {}
+
+  [[nodiscard]] const void* get() const noexcept {
+    return reinterpret_cast<const void*>(key);
+  }
+
+private:
+  std::uintptr_t key;
+};
+
+// Selects snapshot isolation for a Transaction, see tm_begin_si
+struct SnapshotIsolation {};
+inline constexpr SnapshotIsolation snapshot_isolation{};
+
+// A transaction on a Shared, rolled back if it goes out of scope before
+// commit(). Once an operation fails, the engine already rolled it back and
+// the transaction is over: start a new one to retry.
+class Transaction {
+  template <typename Memory>
+  using tx_of = typename std::decay_t<Memory>::Tx;
+
+  // Calls `func` with the engine and this transaction's state in it
+  template <typename Func> decltype(auto) on_tx(Func&& func) {
+    return shared.visit([&](auto& mem) -> decltype(auto) {
+      return func(mem, std::get<tx_of<decltype(mem)>>(tx));
+    });
+  }
+
+  // Inside a nested scope, a failed operation leaves the transaction to the
+  // scope's end
+  bool finish_unless(bool success) {
+    if (!success &&
+        !on_tx([](auto& mem, auto& tx) { return mem.nested(tx); })) {
+      tx.emplace<std::monostate>();
+    }
+    return success;
+  }
+
+public:
+  Transaction(Shared& shared, bool is_ro, CallSite site = {})
+      : shared(shared) {
+    shared.visit([&](auto& mem) {
+      tx.emplace<tx_of<decltype(mem)>>(mem.begin_tx(is_ro, site.get()));
+    });
+  }
+
+  // See tm_begin_priority
+  Transaction(Shared& shared, bool is_ro, Priority priority,
+              std::uint64_t budget_ns = 0, CallSite site = {})
+      : shared(shared) {
+    shared.visit([&](auto& mem) {
+      tx.emplace<tx_of<decltype(mem)>>(
+          mem.begin_tx(is_ro, site.get(), priority, budget_ns));
+    });
+  }
+
+  Transaction(Shared& shared, SnapshotIsolation, CallSite site = {})
+      : shared(shared) {
+    shared.visit([&](auto& mem) {
+      tx.emplace<tx_of<decltype(mem)>>(mem.begin_si(site.get()));
+    });
+  }
+
+  ~Transaction() {
+    if (active()) {
+      on_tx([](auto& mem, auto& tx) { mem.cancel(tx); });
+    }
+  }
+
+  Transaction(const Transaction&) = delete;
+  Transaction& operator=(const Transaction&) = delete;
+
+  [[nodiscard]] bool active() const noexcept {
+    return !std::holds_alternative<std::monostate>(tx);
+  }
+
+  // Typed accesses: sizeof(T) must be a multiple of the region's alignment
+  template <typename T> [[nodiscard]] std::optional<T> read(const T* source) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    T value;
+    if (!read(source, sizeof(T), &value)) {
+      return std::nullopt;
+    }
+    return value;
+  }
+
+  template <typename T> bool write(T* target, const T& value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    return write(&value, sizeof(T), target);
+  }
+
+  // Snapshot of *source, valid until the transaction ends; null if it aborted
+  template <typename T> [[nodiscard]] const T* view(const T* source) {
+    return static_cast<const T*>(view(source, sizeof(T)));
+  }
+
+  const void* view(const void* source, std::size_t size) {
+    auto* result = on_tx([&](auto& mem, auto& tx) {
+      return mem.read_view(tx, source, size);
+    });
+    finish_unless(result != nullptr);
+    return result;
+  }
+
+  bool read(const void* source, std::size_t size, void* target) {
+    return finish_unless(on_tx([&](auto& mem, auto& tx) {
+      return mem.read(tx, source, size, target);
+    }));
+  }
+
+  bool write(const void* source, std::size_t size, void* target) {
+    return finish_unless(on_tx([&](auto& mem, auto& tx) {
+      return mem.write(tx, source, size, target);
+    }));
+  }
+
+  bool read_many(const Access* accesses, std::size_t count) {
+    return finish_unless(on_tx([&](auto& mem, auto& tx) {
+      return mem.read_many(tx, accesses, count);
+    }));
+  }
+
+  bool write_many(const Access* accesses, std::size_t count) {
+    return finish_unless(on_tx([&](auto& mem, auto& tx) {
+      return mem.write_many(tx, accesses, count);
+    }));
+  }
+
+  // Adds `delta` to the integer word at `target` when committing, keeping it
+  // within [min, max]
+  bool add(void* target, std::int64_t delta,
+           std::int64_t min = std::numeric_limits<std::int64_t>::min(),
+           std::int64_t max = std::numeric_limits<std::int64_t>::max()) {
+    return finish_unless(on_tx([&](auto& mem, auto& tx) {
+      return mem.add(tx, target, Delta{delta, min, max});
+    }));
+  }
+
+  Alloc alloc(std::size_t size, void** target) {
+    auto result = on_tx([&](auto& mem, auto& tx) {
+      if (!mem.writable(tx)) {
+        return Alloc::abort;
+      }
+      return mem.allocate(tx, size, target) ? Alloc::success : Alloc::nomem;
+    });
+    finish_unless(result != Alloc::abort);
+    return result;
+  }
+
+  bool free(void* target) {
+    return finish_unless(on_tx([&](auto& mem, auto& tx) {
+      if (!mem.writable(tx)) {
+        return false;
+      }
+      mem.free(tx, target);
+      return true;
+    }));
+  }
+
+  // Runs `body` in a closed nested scope, again for as long as conflicts only
+  // roll back the scope. Once an operation in it fails, `body` should return.
+  // Whether the scope ended up merged into this transaction.
+  template <typename Body> bool nested(Body&& body) {
+    while (true) {
+      on_tx([](auto& mem, auto& tx) { mem.begin_nested(tx); });
+      body();
+      auto scope =
+          on_tx([](auto& mem, auto& tx) { return mem.end_nested(tx); });
+      if (scope == Scope::retry) {
+        continue;
+      }
+      if (scope == Scope::aborted) {
+        tx.emplace<std::monostate>();
+      }
+      return scope == Scope::committed;
+    }
+  }
+
+  // Whether the transaction committed; it's over either way
+  bool commit() {
+    bool committed =
+        on_tx([](auto& mem, auto& tx) { return mem.end_tx(tx); });
+    tx.emplace<std::monostate>();
+    return committed;
+  }
+
+private:
+  Shared& shared;
+  std::variant<std::monostate, MvccTransaction, NorecTransaction> tx;
+};
+
+} // namespace stm
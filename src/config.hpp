@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdlib>
+#include <string_view>
+
+// Tunables, read from the environment whenever a region is created.
+struct Config {
+  // Which engine implements the region:
+  // - mvcc: per-word versioned locks and version chains (SharedMemory)
+  // - norec: one sequence lock, value-validated reads (NorecMemory)
+  enum class Engine { mvcc, norec };
+
+  // Which MVCC policies the region is instantiated with, see policies.hpp
+  enum class Versioning { lazy, eager, adaptive };
+  enum class Clock { global, thread };
+
+  Engine engine = Engine::mvcc;
+  Versioning versioning = Versioning::lazy;
+  Clock clock = Clock::global;
+  // How many times a committer re-checks a busy lock before giving up
+  unsigned lock_spin = 64;
+  // Segments of at least this many bytes keep their versions per 4 KiB page
+  // rather than per word: far less to hold and to scan, but each commit
+  // copies the pages it writes. 0 keeps every segment per word.
+  std::size_t page_segments = 0;
+  // Queue the transactions of threads that keep aborting behind those of
+  // the threads they likely conflict with, see conflict-scheduler.hpp. Off
+  // by default: it only pays off under heavy contention on a few words.
+  bool schedule = false;
+  // Print commit/abort counters when the region is destroyed
+  bool print_stats = false;
+
+  static Config from_env() noexcept {
+    Config config;
+    if (env_is("TM_ENGINE", "norec")) {
+      config.engine = Engine::norec;
+    }
+    if (env_is("TM_VERSIONING", "eager")) {
+      config.versioning = Versioning::eager;
+    } else if (env_is("TM_VERSIONING", "adaptive")) {
+      config.versioning = Versioning::adaptive;
+    }
+    if (env_is("TM_CLOCK", "thread")) {
+      config.clock = Clock::thread;
+    }
+    config.lock_spin = env_or("TM_LOCK_SPIN", config.lock_spin);
+    config.page_segments = env_or("TM_PAGE_SEGMENTS", 0u);
+    config.schedule = env_or("TM_SCHEDULE", 0u) != 0;
+    config.print_stats = env_or("TM_STATS", 0u) != 0;
+    return config;
+  }
+
+private:
+  static bool env_is(const char* name, std::string_view expected) noexcept {
+    const char* value = std::getenv(name);
+    return value != nullptr && expected == value;
+  }
+
+  static unsigned env_or(const char* name, unsigned fallback) noexcept {
+    const char* value = std::getenv(name);
+    if (value == nullptr || *value == '\0') {
+      return fallback;
+    }
+    return static_cast<unsigned>(std::strtoul(value, nullptr, 10));
+  }
+};
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <thread>
+
+#include "shared-segment.hpp"
+#include "thread-slot.hpp"
+
+// Queues the read-write transactions of threads that keep aborting behind
+// each other, in the style of ATS. Each thread tracks how often its
+// transactions abort on a conflict (its contention intensity), and the last
+// words they aborted on (its predicted conflicts). Once contended, its
+// transactions take the queues those words hash to before starting, so that
+// two contended threads predicted to conflict run one after the other;
+// everyone else still runs optimistically.
+class ConflictScheduler {
+public:
+  using Counter = std::atomic<std::uint_fast64_t>;
+  // Set of queues, one bit each
+  using Queues = std::uint16_t;
+
+  static constexpr std::size_t QUEUES = 16;
+  // Contention intensity, out of INTENSITY_ONE. Each conflict moves it
+  // halfway up to INTENSITY_ONE, each commit halfway down to 0.
+  static constexpr unsigned INTENSITY_ONE = 256;
+  // Two conflicts in a row make a thread contended...
+  static constexpr unsigned CONTENDED_FROM = 192;
+  // ...and a few commits in a row make it forget the words it aborted on
+  static constexpr unsigned FORGET_BELOW = 32;
+  // Words predicted per thread: the more, the more queues to take
+  static constexpr std::size_t PREDICTED = 2;
+  // Yields a busy queue gets before its thread gives up on the queues and
+  // runs optimistically
+  static constexpr unsigned WAIT_ROUNDS = 64;
+
+  ConflictScheduler()
+      : threads(std::make_unique<Thread[]>(ThreadSlot::MAX_THREADS)) {}
+
+  // Waits for the queues of a contended thread's predicted conflicts, then
+  // returns them. If one stays busy, e.g. because its holder was preempted,
+  // returns none instead: the transaction runs optimistically.
+  Queues enter(std::size_t slot) noexcept {
+    if (slot == ThreadSlot::NONE) {
+      return 0;
+    }
+    // A thread already in a queue runs its other transactions (coroutines)
+    // optimistically, rather than wait for itself
+    auto& thread = threads[slot];
+    if (thread.intensity < CONTENDED_FROM || thread.queued) {
+      return 0;
+    }
+    // Always in the same order, so that queued threads never deadlock
+    Queues queues = 0;
+    for (auto queue : thread.predicted) {
+      queues |= queue;
+    }
+    for (std::size_t i = 0; i < QUEUES; ++i) {
+      if ((queues & (1u << i)) != 0 && !wait_for(queue[i].mutex)) {
+        // Only the ones taken so far
+        release(queues & ((1u << i) - 1));
+        gave_up.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+      }
+    }
+    thread.queued = queues != 0;
+    serialized.fetch_add(1, std::memory_order_relaxed);
+    return queues;
+  }
+
+  // Must follow every enter(), once the transaction committed or aborted.
+  // `conflict` is the word it aborted on, if it did on a conflict.
+  void leave(std::size_t slot, Queues queues, bool committed,
+             std::optional<ObjectId> conflict) noexcept {
+    release(queues);
+    if (slot == ThreadSlot::NONE) {
+      return;
+    }
+
+    auto& thread = threads[slot];
+    if (queues != 0) {
+      thread.queued = false;
+    }
+    if (committed) {
+      thread.intensity /= 2;
+      if (thread.intensity < FORGET_BELOW) {
+        thread.predicted = {};
+      }
+    } else if (conflict) {
+      thread.intensity = (thread.intensity + INTENSITY_ONE) / 2;
+      thread.predicted[thread.next_predicted] = 1u << queue_of(*conflict);
+      thread.next_predicted = (thread.next_predicted + 1) % PREDICTED;
+    }
+  }
+
+  void print(std::ostream& out) const {
+    out << "serialized=" << serialized.load(std::memory_order_relaxed)
+        << " queue_waits=" << waited.load(std::memory_order_relaxed)
+        << " queue_gave_up=" << gave_up.load(std::memory_order_relaxed)
+        << '\n';
+  }
+
+private:
+  bool wait_for(std::mutex& mutex) noexcept {
+    if (mutex.try_lock()) {
+      return true;
+    }
+    waited.fetch_add(1, std::memory_order_relaxed);
+    for (unsigned round = 0; round < WAIT_ROUNDS; ++round) {
+      std::this_thread::yield();
+      if (mutex.try_lock()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void release(Queues queues) noexcept {
+    for (std::size_t i = 0; i < QUEUES; ++i) {
+      if ((queues & (1u << i)) != 0) {
+        queue[i].mutex.unlock();
+      }
+    }
+  }
+
+  static std::size_t queue_of(ObjectId addr) noexcept {
+    return (opaque(addr) * 0x9e3779b97f4a7c15ul) >> 60;
+  }
+
+  // Only ever touched by the thread in the slot
+  struct alignas(64) Thread {
+    unsigned intensity = 0;
+    // Queue of each predicted word, oldest replaced first
+    std::array<Queues, PREDICTED> predicted{};
+    std::size_t next_predicted = 0;
+    bool queued = false;
+  };
+
+  struct alignas(64) Queue {
+    std::mutex mutex;
+  };
+
+  std::unique_ptr<Thread[]> threads;
+  Queue queue[QUEUES];
+
+  Counter serialized{0};
+  Counter waited{0};
+  Counter gave_up{0};
+};
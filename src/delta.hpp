@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+// A commutative update of an integer word: the amount is kept aside and only
+// added to the latest committed value at commit, so that concurrent deltas
+// on the same word neither read it nor conflict with each other. The result
+// must stay within [min, max] (escrow bounds), or the transaction aborts.
+struct Delta {
+  std::int64_t amount;
+  std::int64_t min;
+  std::int64_t max;
+
+  // Words that hold a signed integer a delta can be added to
+  static bool applies_to(std::size_t size) noexcept {
+    return size == 1 || size == 2 || size == 4 || size == 8;
+  }
+
+  // Folds a later delta on the same word into this one. The bounds of both
+  // only apply to the final value.
+  [[nodiscard]] bool merge(const Delta& later) noexcept {
+    if (__builtin_add_overflow(amount, later.amount, &amount)) {
+      return false;
+    }
+    min = std::max(min, later.min);
+    max = std::min(max, later.max);
+    return true;
+  }
+
+  // Adds the amount to the signed integer of `size` bytes at `word`. Leaves
+  // it untouched if the result would be out of bounds or not fit the word.
+  [[nodiscard]] bool apply(char* word, std::size_t size) const noexcept {
+    switch (size) {
+    case 1:
+      return apply_as<std::int8_t>(word);
+    case 2:
+      return apply_as<std::int16_t>(word);
+    case 4:
+      return apply_as<std::int32_t>(word);
+    case 8:
+      return apply_as<std::int64_t>(word);
+    default:
+      return false;
+    }
+  }
+
+private:
+  template <typename Int> bool apply_as(char* word) const noexcept {
+    Int value;
+    std::memcpy(&value, word, sizeof(Int));
+    std::int64_t result;
+    if (__builtin_add_overflow(std::int64_t(value), amount, &result) ||
+        result < std::max<std::int64_t>(min, std::numeric_limits<Int>::min()) ||
+        result > std::min<std::int64_t>(max, std::numeric_limits<Int>::max())) {
+      return false;
+    }
+    value = static_cast<Int>(result);
+    std::memcpy(word, &value, sizeof(Int));
+    return true;
+  }
+};
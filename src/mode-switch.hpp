@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "thread-slot.hpp"
+
+// How read-write transactions run under adaptive versioning:
+// - lazy: optimistic, writes buffered and locked at commit
+// - eager: writes locked and installed in place when they happen
+// - coarse: serialized on a single mutex, so they never conflict
+enum class Mode : std::uint8_t { lazy, eager, coarse };
+
+inline const char* to_string(Mode mode) noexcept {
+  switch (mode) {
+  case Mode::lazy:
+    return "lazy";
+  case Mode::eager:
+    return "eager";
+  case Mode::coarse:
+    return "coarse";
+  }
+  return "?";
+}
+
+// Samples how read-write transactions end, and switches modes for the ones
+// that start next. Modes only differ in how a transaction handles its own
+// writes, so transactions still running in the previous mode finish in it
+// alongside the new ones: nobody waits for a switch.
+class ModeSwitch {
+public:
+  using Counter = std::atomic<std::uint_fast64_t>;
+
+  // Read-write transactions per sampling window
+  static constexpr std::uint_fast64_t WINDOW = 1024;
+  // Abort rates over a window that move to a more pessimistic mode...
+  static constexpr double EAGER_ABOVE = 0.05;
+  static constexpr double COARSE_ABOVE = 0.3;
+  // ...and back to optimistic execution
+  static constexpr double LAZY_BELOW = 0.01;
+  // Share of coarse transactions that had to wait for the mutex, below which
+  // serializing them no longer pays off
+  static constexpr double CONTENDED_BELOW = 0.1;
+  // Windows in a row that must call for the same mode before switching to
+  // it, so that a single noisy window doesn't flip modes back and forth...
+  static constexpr unsigned CONFIRM_WINDOWS = 2;
+  // ...twice as many to leave a pessimistic mode each time it's re-entered
+  // within RELAPSE_WINDOWS of leaving it, up to 2^MAX_RELAPSES times as many
+  static constexpr std::uint_fast64_t RELAPSE_WINDOWS = 16;
+  static constexpr unsigned MAX_RELAPSES = 4;
+  // Switches kept for printing; later ones are only counted
+  static constexpr std::size_t HISTORY = 64;
+  // Yields a transaction waits for the coarse mutex before running lazily
+  static constexpr unsigned COARSE_WAIT_ROUNDS = 64;
+
+  // Returns the mode the transaction runs in. Transactions that may not
+  // wait for the coarse mutex, whose thread already holds it, or that waited
+  // COARSE_WAIT_ROUNDS for it in vain (its holder may be preempted) run
+  // lazily instead.
+  Mode enter(std::size_t slot, bool may_wait) noexcept {
+    auto current = mode.load(std::memory_order_relaxed);
+    if (current != Mode::coarse) {
+      return current;
+    }
+    if (!may_wait || slot == ThreadSlot::NONE ||
+        holder.load(std::memory_order_relaxed) == slot) {
+      return Mode::lazy;
+    }
+    if (!coarse_mutex.try_lock()) {
+      contended.fetch_add(1, std::memory_order_relaxed);
+      for (unsigned round = 0;; ++round) {
+        if (round == COARSE_WAIT_ROUNDS) {
+          fell_back.fetch_add(1, std::memory_order_relaxed);
+          return Mode::lazy;
+        }
+        std::this_thread::yield();
+        if (coarse_mutex.try_lock()) {
+          break;
+        }
+      }
+    }
+    holder.store(slot, std::memory_order_relaxed);
+    return current;
+  }
+
+  // Must follow every enter(), once the transaction committed or aborted
+  void leave(Mode entered, bool committed, std::size_t reads,
+             std::size_t writes) noexcept {
+    if (entered == Mode::coarse) {
+      holder.store(ThreadSlot::NONE, std::memory_order_relaxed);
+      coarse_mutex.unlock();
+      // Coarse transactions only conflict with ones from before the switch,
+      // or ones committing: give those the time to finish
+      if (!committed) {
+        std::this_thread::yield();
+      }
+    }
+
+    (committed ? commits : aborts).fetch_add(1, std::memory_order_relaxed);
+    read_words.fetch_add(reads, std::memory_order_relaxed);
+    written_words.fetch_add(writes, std::memory_order_relaxed);
+    if (ended.fetch_add(1, std::memory_order_relaxed) % WINDOW == WINDOW - 1) {
+      sample();
+    }
+  }
+
+  [[nodiscard]] Mode current() const noexcept { return mode.load(); }
+
+  void print(std::ostream& out) {
+    std::unique_lock lock(history_mutex);
+    out << "mode=" << to_string(mode.load()) << " switches=" << switches
+        << " coarse_fell_back=" << fell_back.load(std::memory_order_relaxed);
+    for (auto& entry : history) {
+      out << ' ' << to_string(entry.from) << "->" << to_string(entry.to)
+          << "@" << entry.at << "(abort_rate=" << entry.abort_rate << ')';
+    }
+    out << '\n';
+  }
+
+private:
+  struct Switch {
+    std::uint_fast64_t at; // Read-write transactions ended so far
+    Mode from;
+    Mode to;
+    double abort_rate;
+  };
+
+  void sample() noexcept {
+    // A window that ends while the previous one is still being sampled is
+    // folded into the next one
+    std::unique_lock lock(history_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      return;
+    }
+    double c = commits.exchange(0, std::memory_order_relaxed);
+    double a = aborts.exchange(0, std::memory_order_relaxed);
+    double waited = contended.exchange(0, std::memory_order_relaxed);
+    double reads = read_words.exchange(0, std::memory_order_relaxed);
+    double writes = written_words.exchange(0, std::memory_order_relaxed);
+    auto total = c + a;
+    if (total == 0) {
+      return;
+    }
+    auto abort_rate = a / total;
+    windows++;
+
+    auto from = mode.load();
+    auto to = from;
+    if (from == Mode::coarse) {
+      if (waited / total < CONTENDED_BELOW) {
+        to = Mode::lazy;
+      }
+    } else if (abort_rate > COARSE_ABOVE) {
+      to = Mode::coarse;
+    } else if (abort_rate > EAGER_ABOVE && writes <= reads) {
+      // Conflicts then show up before most of the reads were wasted
+      to = Mode::eager;
+    } else if (abort_rate < LAZY_BELOW) {
+      to = Mode::lazy;
+    }
+    if (to == from) {
+      votes = 0;
+      return;
+    }
+    votes = to == proposed ? votes + 1 : 1;
+    proposed = to;
+    if (votes < (from == Mode::lazy ? CONFIRM_WINDOWS
+                                    : CONFIRM_WINDOWS << relapses)) {
+      return;
+    }
+
+    votes = 0;
+    if (to == Mode::lazy) {
+      left_at = windows;
+    } else if (from == Mode::lazy) {
+      relapses = windows - left_at <= RELAPSE_WINDOWS
+                     ? std::min(relapses + 1, MAX_RELAPSES)
+                     : 0;
+    }
+    mode.store(to);
+    switches++;
+    if (history.size() < HISTORY) {
+      history.push_back(
+          {ended.load(std::memory_order_relaxed), from, to, abort_rate});
+    }
+  }
+
+  std::atomic<Mode> mode{Mode::lazy};
+  std::mutex coarse_mutex;
+  // Slot of the thread holding coarse_mutex, if any
+  std::atomic<std::size_t> holder{ThreadSlot::NONE};
+
+  // Current sampling window
+  Counter commits{0};
+  Counter aborts{0};
+  Counter contended{0};
+  Counter read_words{0};
+  Counter written_words{0};
+  Counter ended{0};
+
+  // Also held while sampling
+  std::mutex history_mutex;
+  Mode proposed = Mode::lazy;
+  unsigned votes = 0;
+  // Windows sampled, and the last one that left a pessimistic mode
+  std::uint_fast64_t windows = 0;
+  std::uint_fast64_t left_at = 0;
+  unsigned relapses = 0;
+  std::uint_fast64_t switches = 0;
+  std::vector<Switch> history;
+  Counter fell_back{0};
+};
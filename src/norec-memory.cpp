@@ -0,0 +1,567 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "norec-memory.hpp"
+#include "spinlock.hpp"
+
+// Returned by validate() when a value changed under us
+static constexpr std::uint_fast64_t INVALID = 1;
+
+// Shared words are read and written concurrently, so machine-sized words go
+// through atomic accesses. Wider words are copied as is: a torn copy is
+// caught by the validation that follows every read.
+template <typename Word> static void load_as(char* dst, const char* src) {
+  Word value =
+      __atomic_load_n(reinterpret_cast<const Word*>(src), __ATOMIC_RELAXED);
+  std::memcpy(dst, &value, sizeof(Word));
+}
+
+template <typename Word> static void store_as(char* dst, const char* src) {
+  Word value;
+  std::memcpy(&value, src, sizeof(Word));
+  __atomic_store_n(reinterpret_cast<Word*>(dst), value, __ATOMIC_RELAXED);
+}
+
+static void load_word(char* dst, const char* src, std::size_t align) {
+  switch (align) {
+  case 1:
+    return load_as<std::uint8_t>(dst, src);
+  case 2:
+    return load_as<std::uint16_t>(dst, src);
+  case 4:
+    return load_as<std::uint32_t>(dst, src);
+  case 8:
+    return load_as<std::uint64_t>(dst, src);
+  default:
+    std::memcpy(dst, src, align);
+  }
+}
+
+static void store_word(char* dst, const char* src, std::size_t align) {
+  switch (align) {
+  case 1:
+    return store_as<std::uint8_t>(dst, src);
+  case 2:
+    return store_as<std::uint16_t>(dst, src);
+  case 4:
+    return store_as<std::uint32_t>(dst, src);
+  case 8:
+    return store_as<std::uint64_t>(dst, src);
+  default:
+    std::memcpy(dst, src, align);
+  }
+}
+
+static bool same_word(const char* shared, const char* logged,
+                      std::size_t align) {
+  if (align > sizeof(std::uint64_t)) {
+    return std::memcmp(shared, logged, align) == 0;
+  }
+  char current[sizeof(std::uint64_t)];
+  load_word(current, shared, align);
+  return std::memcmp(current, logged, align) == 0;
+}
+
+NorecMemory::NorecMemory(std::size_t size, std::size_t align,
+                         Config config) noexcept
+    : align(align), stats(config.print_stats),
+      readers(std::make_unique<Reader[]>(ThreadSlot::MAX_THREADS)),
+      first_size(size) {
+  first = take_block(size);
+}
+
+NorecMemory::~NorecMemory() noexcept {
+  if (stats.active()) {
+    stats.print(std::cerr);
+  }
+  for (auto [block, size] : block_sizes) {
+    std::free(block);
+  }
+}
+
+NorecTransaction NorecMemory::begin_tx(bool is_ro, const void*, Priority,
+                                       std::uint64_t) noexcept {
+  NorecTransaction tx;
+  tx.is_ro = is_ro;
+  tx.running = true;
+  tx.slot = ThreadSlot::index();
+  if (tx.slot == ThreadSlot::NONE) {
+    unslotted.fetch_add(1);
+  } else if (readers[tx.slot].running++ == 0) {
+    // Re-check the sequence lock after announcing: a reclaim() that missed
+    // our announcement read it before the snapshot we end up starting from
+    auto& announced = readers[tx.slot].announced;
+    auto time = last_commit();
+    while (true) {
+      announced.store(time);
+      auto again = last_commit();
+      if (again == time) {
+        break;
+      }
+      time = again;
+    }
+  }
+  do {
+    tx.snapshot = seqlock.load(std::memory_order_acquire);
+  } while (tx.snapshot & 1);
+  return tx;
+}
+
+void NorecMemory::leave(NorecTransaction& tx) noexcept {
+  if (!tx.running) {
+    return;
+  }
+  tx.running = false;
+  if (tx.slot == ThreadSlot::NONE) {
+    unslotted.fetch_sub(1, std::memory_order_release);
+  } else if (--readers[tx.slot].running == 0) {
+    readers[tx.slot].announced.store(Reader::IDLE, std::memory_order_release);
+  }
+}
+
+std::uint_fast64_t
+NorecMemory::validate(const NorecTransaction& tx) const noexcept {
+  while (true) {
+    auto time = seqlock.load(std::memory_order_acquire);
+    if (time & 1) {
+      cpu_relax();
+      continue;
+    }
+    const char* logged = tx.read_values.data();
+    for (auto* addr : tx.read_set) {
+      if (!same_word(addr, logged, align)) {
+        return INVALID;
+      }
+      logged += align;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seqlock.load(std::memory_order_relaxed) == time) {
+      return time;
+    }
+  }
+}
+
+bool NorecMemory::read(NorecTransaction& tx, const void* source,
+                       std::size_t size, void* target) noexcept {
+  const auto* src = reinterpret_cast<const char*>(source);
+  auto* dst = reinterpret_cast<char*>(target);
+  for (std::size_t offset = 0; offset < size; offset += align) {
+    const char* addr = src + offset;
+    NorecTransaction::WriteEntry* entry = nullptr;
+    if (!tx.is_ro) {
+      entry = tx.find_write_entry(addr);
+      if (entry != nullptr && !entry->delta) {
+        std::memcpy(dst + offset, tx.write_values.data() + entry->value,
+                    align);
+        continue;
+      }
+    }
+
+    load_word(dst + offset, addr, align);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // Someone committed since our snapshot: only continue if everything we
+    // read so far still holds, and re-read the word in the new snapshot
+    while (seqlock.load(std::memory_order_relaxed) != tx.snapshot) {
+      auto snapshot = validate(tx);
+      if (snapshot == INVALID) {
+        stats.count(stats.validation_aborts);
+        conflict(tx);
+        return false;
+      }
+      tx.snapshot = snapshot;
+      load_word(dst + offset, addr, align);
+      std::atomic_thread_fence(std::memory_order_acquire);
+    }
+
+    tx.read_set.push_back(addr);
+    tx.read_values.insert(tx.read_values.end(), dst + offset,
+                          dst + offset + align);
+
+    // The value now depends on the word: the delta becomes a plain write
+    if (entry != nullptr) {
+      save_entry(tx, *entry);
+      if (!entry->delta->apply(dst + offset, align)) {
+        stats.count(stats.escrow_aborts);
+        conflict(tx);
+        return false;
+      }
+      std::memcpy(tx.write_values.data() + entry->value, dst + offset, align);
+      entry->delta.reset();
+    }
+  }
+  return true;
+}
+
+bool NorecMemory::write(NorecTransaction& tx, const void* source,
+                        std::size_t size, void* target) noexcept {
+  const auto* src = reinterpret_cast<const char*>(source);
+  auto* dst = reinterpret_cast<char*>(target);
+  for (std::size_t offset = 0; offset < size; offset += align) {
+    if (auto entry = tx.find_write_entry(dst + offset)) {
+      save_entry(tx, *entry);
+      std::memcpy(tx.write_values.data() + entry->value, src + offset, align);
+      entry->delta.reset();
+      continue;
+    }
+    tx.write_set.push_back({dst + offset, tx.write_values.size()});
+    tx.write_values.insert(tx.write_values.end(), src + offset,
+                           src + offset + align);
+  }
+  return true;
+}
+
+bool NorecMemory::add(NorecTransaction& tx, void* target,
+                      const Delta& delta) noexcept {
+  // Otherwise every commit would fail to apply it
+  if (!Delta::applies_to(align)) {
+    abort(tx);
+    return false;
+  }
+  auto* addr = static_cast<char*>(target);
+  if (auto entry = tx.find_write_entry(addr)) {
+    save_entry(tx, *entry);
+    auto ok = entry->delta
+                  ? entry->delta->merge(delta)
+                  : delta.apply(tx.write_values.data() + entry->value, align);
+    if (!ok) {
+      stats.count(stats.escrow_aborts);
+      conflict(tx);
+    }
+    return ok;
+  }
+  tx.write_set.push_back({addr, tx.write_values.size(), delta});
+  tx.write_values.resize(tx.write_values.size() + align);
+  return true;
+}
+
+const void* NorecMemory::read_view(NorecTransaction& tx, const void* source,
+                                   std::size_t size) noexcept {
+  auto* chunk = tx.views.allocate(size);
+  if (!read(tx, source, size, chunk)) {
+    return nullptr;
+  }
+  return chunk;
+}
+
+// Without per-word metadata there's nothing to look up ahead of time
+bool NorecMemory::read_many(NorecTransaction& tx, const Access* accesses,
+                            std::size_t count) noexcept {
+  for (std::size_t i = 0; i < count; ++i) {
+    auto& access = accesses[i];
+    if (!read(tx, access.shared, access.size, access.buffer)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool NorecMemory::write_many(NorecTransaction& tx, const Access* accesses,
+                             std::size_t count) noexcept {
+  for (std::size_t i = 0; i < count; ++i) {
+    auto& access = accesses[i];
+    if (!write(tx, access.buffer, access.size, access.shared)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool NorecMemory::silent(const NorecTransaction& tx) const noexcept {
+  auto same_values = [&] {
+    for (auto& write : tx.write_set) {
+      if (write.delta || !same_word(write.addr,
+                                    tx.write_values.data() + write.value,
+                                    align)) {
+        return false;
+      }
+    }
+    return true;
+  };
+  // Most of the time the first write differs, before any validation
+  if (!same_values()) {
+    return false;
+  }
+  auto time = validate(tx);
+  if (time == INVALID || !same_values()) {
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return seqlock.load(std::memory_order_relaxed) == time;
+}
+
+bool NorecMemory::end_tx(NorecTransaction& tx) noexcept {
+  // Every read was validated against the latest snapshot already
+  if (tx.write_set.empty() && tx.free_set.empty()) {
+    leave(tx);
+    stats.count(stats.commits);
+    return true;
+  }
+  // No need to make everybody revalidate for writes that change nothing
+  if (tx.free_set.empty() && silent(tx)) {
+    for (std::size_t i = 0; i < tx.write_set.size(); ++i) {
+      stats.count(stats.silent_stores);
+    }
+    leave(tx);
+    stats.count(stats.commits);
+    return true;
+  }
+
+  auto snapshot = tx.snapshot;
+  while (!seqlock.compare_exchange_weak(snapshot, snapshot + 1,
+                                        std::memory_order_acquire,
+                                        std::memory_order_relaxed)) {
+    snapshot = validate(tx);
+    if (snapshot == INVALID) {
+      stats.count(stats.validation_aborts);
+      abort(tx);
+      return false;
+    }
+  }
+
+  // Nobody writes while we hold the lock: add the deltas to the current
+  // values before writing anything back
+  for (auto& write : tx.write_set) {
+    if (!write.delta) {
+      continue;
+    }
+    auto* value = tx.write_values.data() + write.value;
+    load_word(value, write.addr, align);
+    if (!write.delta->apply(value, align)) {
+      // Nothing was written, so the snapshot is still current
+      seqlock.store(snapshot, std::memory_order_release);
+      stats.count(stats.escrow_aborts);
+      abort(tx);
+      return false;
+    }
+  }
+
+  for (auto& write : tx.write_set) {
+    store_word(write.addr, tx.write_values.data() + write.value, align);
+  }
+  seqlock.store(snapshot + 2, std::memory_order_release);
+  leave(tx);
+
+  if (!tx.free_set.empty()) {
+    for (auto* block : tx.free_set) {
+      return_block(block, snapshot + 2);
+    }
+    reclaim();
+  }
+  stats.count(stats.commits);
+  return true;
+}
+
+void NorecMemory::atomic_load(const void* source,
+                              void* target) const noexcept {
+  while (true) {
+    auto time = seqlock.load(std::memory_order_acquire);
+    if (time & 1) {
+      cpu_relax();
+      continue;
+    }
+    load_word(static_cast<char*>(target), static_cast<const char*>(source),
+              align);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seqlock.load(std::memory_order_relaxed) == time) {
+      return;
+    }
+  }
+}
+
+bool NorecMemory::atomic_store(const void* source, void* target) noexcept {
+  // Transactions only hold the sequence lock while they commit
+  auto time = lock_writers();
+  store_word(static_cast<char*>(target), static_cast<const char*>(source),
+             align);
+  seqlock.store(time + 2, std::memory_order_release);
+  return true;
+}
+
+bool NorecMemory::atomic_cas(void* target, void* expected,
+                             const void* desired) noexcept {
+  auto* word = static_cast<char*>(target);
+  auto time = lock_writers();
+  if (!same_word(word, static_cast<const char*>(expected), align)) {
+    load_word(static_cast<char*>(expected), word, align);
+    // Nothing was written, so the snapshot is still current
+    seqlock.store(time, std::memory_order_release);
+    return false;
+  }
+  store_word(word, static_cast<const char*>(desired), align);
+  seqlock.store(time + 2, std::memory_order_release);
+  return true;
+}
+
+std::uint_fast64_t NorecMemory::lock_writers() noexcept {
+  auto time = seqlock.load(std::memory_order_relaxed);
+  while (true) {
+    if (time & 1) {
+      cpu_relax();
+      time = seqlock.load(std::memory_order_relaxed);
+    } else if (seqlock.compare_exchange_weak(time, time + 1,
+                                             std::memory_order_acquire,
+                                             std::memory_order_relaxed)) {
+      return time;
+    }
+  }
+}
+
+void NorecMemory::abort(NorecTransaction& tx) noexcept {
+  stats.count(stats.aborts);
+  tx.aborted = true;
+  leave(tx);
+  // Never reachable from another transaction
+  for (auto* block : tx.alloc_set) {
+    return_block(block, last_commit());
+  }
+}
+
+void NorecMemory::begin_nested(NorecTransaction& tx) noexcept {
+  tx.savepoints.push_back({tx.next_savepoint++, tx.read_set.size(),
+                           tx.write_set.size(), tx.alloc_set.size(),
+                           tx.free_set.size(), tx.saved_entries.size()});
+}
+
+Scope NorecMemory::end_nested(NorecTransaction& tx) noexcept {
+  if (tx.aborted) {
+    return Scope::aborted;
+  }
+  tx.savepoints.pop_back();
+  if (tx.scope_failed) {
+    tx.scope_failed = false;
+    return Scope::retry;
+  }
+  if (tx.savepoints.empty()) {
+    tx.saved_entries.clear();
+  }
+  return Scope::committed;
+}
+
+void NorecMemory::conflict(NorecTransaction& tx) noexcept {
+  if (!tx.savepoints.empty() && rollback_scope(tx)) {
+    stats.count(stats.scope_rollbacks);
+    tx.scope_failed = true;
+    return;
+  }
+  abort(tx);
+}
+
+bool NorecMemory::rollback_scope(NorecTransaction& tx) noexcept {
+  auto& scope = tx.savepoints.back();
+
+  // Entries are only appended, their values too
+  if (scope.write_set < tx.write_set.size()) {
+    tx.write_values.resize(tx.write_set[scope.write_set].value);
+    tx.write_set.resize(scope.write_set);
+  }
+  // Newest first, so that each entry ends up as it was oldest
+  for (auto i = tx.saved_entries.size(); i-- > scope.saved_entries;) {
+    auto& saved = tx.saved_entries[i];
+    if (saved.index < scope.write_set) {
+      auto& entry = tx.write_set[saved.index] = saved.entry;
+      std::memcpy(tx.write_values.data() + entry.value, saved.value.get(),
+                  align);
+    }
+  }
+  tx.saved_entries.resize(scope.saved_entries);
+
+  tx.read_set.resize(scope.read_set);
+  tx.read_values.resize(scope.read_set * align);
+  for (auto i = scope.alloc_set; i < tx.alloc_set.size(); ++i) {
+    return_block(tx.alloc_set[i], last_commit());
+  }
+  tx.alloc_set.resize(scope.alloc_set);
+  tx.free_set.resize(scope.free_set);
+
+  // What's left must still hold in a snapshot the scope can be retried in
+  auto snapshot = validate(tx);
+  if (snapshot == INVALID) {
+    return false;
+  }
+  tx.snapshot = snapshot;
+  return true;
+}
+
+void NorecMemory::save_entry(NorecTransaction& tx,
+                             NorecTransaction::WriteEntry& entry) {
+  if (tx.savepoints.empty()) {
+    return;
+  }
+  auto& scope = tx.savepoints.back();
+  auto index = static_cast<std::size_t>(&entry - tx.write_set.data());
+  if (index >= scope.write_set || entry.saved_in == scope.id) {
+    return;
+  }
+  auto value = std::make_unique<char[]>(align);
+  std::memcpy(value.get(), tx.write_values.data() + entry.value, align);
+  tx.saved_entries.push_back({index, entry, std::move(value)});
+  entry.saved_in = scope.id;
+}
+
+bool NorecMemory::allocate(NorecTransaction& tx, std::size_t size,
+                           void** target) noexcept {
+  auto* block = take_block(size);
+  if (block == nullptr) {
+    return false;
+  }
+  tx.alloc_set.push_back(block);
+  *target = block;
+  return true;
+}
+
+void NorecMemory::free(NorecTransaction& tx, void* target) noexcept {
+  tx.free_set.push_back(target);
+}
+
+void* NorecMemory::take_block(std::size_t size) {
+  void* block = nullptr;
+  {
+    std::unique_lock lock(blocks_mutex);
+    auto& recycled = free_blocks[size];
+    if (!recycled.empty()) {
+      block = recycled.back().second;
+      recycled.pop_back();
+    } else {
+      auto block_align = std::max(align, sizeof(void*));
+      auto rounded = (size + block_align - 1) / block_align * block_align;
+      block = std::aligned_alloc(block_align, rounded);
+      if (block == nullptr) {
+        return nullptr;
+      }
+      block_sizes.emplace(block, size);
+    }
+  }
+  std::memset(block, 0, size);
+  return block;
+}
+
+void NorecMemory::return_block(void* block, std::uint_fast64_t time) {
+  std::unique_lock lock(blocks_mutex);
+  free_blocks[block_sizes[block]].emplace_back(time, block);
+}
+
+void NorecMemory::reclaim() {
+  // In this order, so that a transaction that begins after either scan
+  // starts from `horizon` or later
+  auto horizon = last_commit();
+  if (unslotted.load() != 0) {
+    return;
+  }
+  const auto threads = ThreadSlot::high_water();
+  for (std::size_t i = 0; i < threads; ++i) {
+    horizon = std::min(horizon, readers[i].announced.load());
+  }
+
+  std::unique_lock lock(blocks_mutex);
+  for (auto& [size, recycled] : free_blocks) {
+    while (!recycled.empty() && recycled.front().first <= horizon) {
+      auto* block = recycled.front().second;
+      recycled.pop_front();
+      block_sizes.erase(block);
+      std::free(block);
+      stats.count(stats.blocks_released);
+    }
+  }
+}
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "config.hpp"
+#include "delta.hpp"
+#include "stats.hpp"
+#include "thread-slot.hpp"
+#include "tm-ext.hpp"
+#include "view-arena.hpp"
+
+// NOrec: a single global sequence lock, value-validated reads and no
+// per-word metadata. Shared addresses are plain pointers into the segments.
+struct NorecTransaction {
+  struct WriteEntry {
+    char* addr;
+    std::size_t value; // Offset into write_values
+    // Set for a delta, whose value is only computed under the sequence lock
+    std::optional<Delta> delta{};
+    // Savepoint that last saved this entry
+    std::size_t saved_in = 0;
+  };
+
+  // What the logs held when a closed nested scope began
+  struct Savepoint {
+    std::size_t id;
+    std::size_t read_set;
+    std::size_t write_set;
+    std::size_t alloc_set;
+    std::size_t free_set;
+    std::size_t saved_entries;
+  };
+
+  // A write entry from before the innermost savepoint, and its value, as
+  // they were before the scope first changed them
+  struct SavedEntry {
+    std::size_t index;
+    WriteEntry entry;
+    std::unique_ptr<char[]> value;
+  };
+
+  [[nodiscard]] WriteEntry* find_write_entry(const char* addr) noexcept {
+    for (auto& entry : write_set) {
+      if (entry.addr == addr) {
+        return &entry;
+      }
+    }
+    return nullptr;
+  }
+
+  bool is_ro;
+  std::uint_fast64_t snapshot;
+  // Values are stored back to back, one word per entry
+  std::vector<const char*> read_set;
+  std::vector<char> read_values;
+  std::vector<WriteEntry> write_set;
+  std::vector<char> write_values;
+  std::vector<void*> alloc_set;
+  std::vector<void*> free_set;
+  ViewArena views;
+
+  // Open nested scopes, innermost last
+  std::vector<Savepoint> savepoints;
+  std::vector<SavedEntry> saved_entries;
+  std::size_t next_savepoint = 1;
+  bool scope_failed = false;
+  bool aborted = false;
+  // Slot of the thread whose announced snapshot covers it, NONE if counted
+  // in NorecMemory::unslotted instead; cleared once it ended
+  std::size_t slot = ThreadSlot::NONE;
+  bool running = false;
+};
+
+class NorecMemory {
+public:
+  using Tx = NorecTransaction;
+
+  NorecMemory(std::size_t size, std::size_t align,
+              Config config = Config{}) noexcept;
+  ~NorecMemory() noexcept;
+
+  NorecMemory(NorecMemory&&) = delete;
+  NorecMemory& operator=(NorecMemory&&) = delete;
+
+  NorecMemory(const NorecMemory&) = delete;
+  NorecMemory& operator=(const NorecMemory&) = delete;
+
+  // Priorities are accepted, but all transactions run alike
+  [[nodiscard]] NorecTransaction
+  begin_tx(bool is_ro, const void* call_site = nullptr,
+           Priority priority = Priority::normal,
+           std::uint64_t budget = 0) noexcept;
+  // Without versions to read a snapshot from, a transaction asking for
+  // snapshot isolation runs as a serializable one, which it tolerates too
+  [[nodiscard]] NorecTransaction
+  begin_si(const void* call_site = nullptr) noexcept {
+    return begin_tx(false, call_site);
+  }
+  // Transactions never wait for each other to begin, and the words they
+  // conflict on aren't tracked: a suspended caller can only back off
+  [[nodiscard]] NorecTransaction
+  begin_suspendable(bool is_ro,
+                    const void* call_site = nullptr) noexcept {
+    return begin_tx(is_ro, call_site);
+  }
+  [[nodiscard]] const void* conflict() const noexcept { return nullptr; }
+  [[nodiscard]] bool locked(const void*) const noexcept { return false; }
+  bool end_tx(NorecTransaction& tx) noexcept;
+  // Without versions, a snapshot only lasts until the next commit: none are
+  // shared
+  struct Snapshot {};
+  [[nodiscard]] Snapshot*
+  export_snapshot(const NorecTransaction&) const noexcept {
+    return nullptr;
+  }
+  [[nodiscard]] NorecTransaction begin_at(const Snapshot&) noexcept {
+    return begin_tx(true);
+  }
+  void release_snapshot(Snapshot*) const noexcept {}
+  // Rolls back a transaction the caller gives up on
+  void cancel(NorecTransaction& tx) noexcept { abort(tx); }
+
+  bool read(NorecTransaction& tx, const void* source, std::size_t size,
+            void* target) noexcept;
+  bool write(NorecTransaction& tx, const void* source, std::size_t size,
+             void* target) noexcept;
+  // Shared memory is updated in place, so views are always copies
+  const void* read_view(NorecTransaction& tx, const void* source,
+                        std::size_t size) noexcept;
+  bool read_many(NorecTransaction& tx, const Access* accesses,
+                 std::size_t count) noexcept;
+  bool write_many(NorecTransaction& tx, const Access* accesses,
+                  std::size_t count) noexcept;
+
+  // Deltas are added at write-back, and only validated if also read
+  bool add(NorecTransaction& tx, void* target, const Delta& delta) noexcept;
+
+  bool allocate(NorecTransaction& tx, std::size_t size,
+                void** target) noexcept;
+  void free(NorecTransaction& tx, void* target) noexcept;
+
+  // Single words outside of any transaction, under the sequence lock
+  void atomic_load(const void* source, void* target) const noexcept;
+  bool atomic_store(const void* source, void* target) noexcept;
+  bool atomic_cas(void* target, void* expected, const void* desired) noexcept;
+
+  bool writable(NorecTransaction&) const noexcept { return true; }
+
+  // Closed nesting, as in SharedMemory: a rolled back scope revalidates the
+  // rest of the transaction by value, from a new snapshot
+  void begin_nested(NorecTransaction& tx) noexcept;
+  Scope end_nested(NorecTransaction& tx) noexcept;
+  [[nodiscard]] bool nested(const NorecTransaction& tx) const noexcept {
+    return !tx.savepoints.empty();
+  }
+
+  [[nodiscard]] std::size_t size() const noexcept { return first_size; }
+
+  [[nodiscard]] std::size_t alignment() const noexcept { return align; }
+
+  [[nodiscard]] void* start_addr() const noexcept { return first; }
+
+private:
+  // Waits for the sequence lock to be even, then checks every value read.
+  // Returns the new snapshot, or an odd value if validation failed.
+  std::uint_fast64_t validate(const NorecTransaction& tx) const noexcept;
+  // Whether every write stores the value already there, while the reads are
+  // still valid: committing then changes nothing
+  bool silent(const NorecTransaction& tx) const noexcept;
+
+  void abort(NorecTransaction& tx) noexcept;
+  // Withdraws the transaction's snapshot from its thread's announcement
+  void leave(NorecTransaction& tx) noexcept;
+  // Rolls back the innermost scope if possible, otherwise aborts
+  void conflict(NorecTransaction& tx) noexcept;
+  bool rollback_scope(NorecTransaction& tx) noexcept;
+  // Saves a write entry before a scope changes it
+  void save_entry(NorecTransaction& tx, NorecTransaction::WriteEntry& entry);
+
+  // Time of the latest commit, even if another one is in progress
+  [[nodiscard]] std::uint_fast64_t last_commit() const noexcept {
+    return seqlock.load() & ~std::uint_fast64_t{1};
+  }
+
+  // Waits for the sequence lock to be even and takes it, returning the time
+  // it was taken at
+  std::uint_fast64_t lock_writers() noexcept;
+
+  void* take_block(std::size_t size);
+  // Recycles a block no longer reachable from snapshots at `time` or later
+  void return_block(void* block, std::uint_fast64_t time);
+  // Releases the recycled blocks that no running transaction can reach
+  void reclaim();
+
+  std::size_t align;
+  Stats stats;
+
+  // Even when idle, odd while a writer is writing back
+  alignas(64) std::atomic<std::uint_fast64_t> seqlock{0};
+
+  // Snapshot of each thread's oldest running transaction. Its later ones
+  // started from the same snapshot or a newer one, so they're covered too.
+  struct alignas(64) Reader {
+    static constexpr auto IDLE =
+        std::numeric_limits<std::uint_fast64_t>::max();
+    std::atomic<std::uint_fast64_t> announced{IDLE};
+    // Only touched by the thread in the slot
+    std::size_t running = 0;
+  };
+  std::unique_ptr<Reader[]> readers;
+  // Running transactions of threads without a slot: nothing is released
+  // while there are any
+  std::atomic<std::size_t> unslotted{0};
+
+  // Freed segments are recycled rather than released right away, so that a
+  // doomed transaction reading one never faults; its value validation then
+  // fails. Once every running transaction started after a segment was freed,
+  // reclaim() releases it. Oldest first, with the time they were freed at.
+  std::mutex blocks_mutex;
+  std::unordered_map<void*, std::size_t> block_sizes;
+  std::unordered_map<std::size_t,
+                     std::deque<std::pair<std::uint_fast64_t, void*>>>
+      free_blocks;
+
+  void* first;
+  std::size_t first_size;
+};
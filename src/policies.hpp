@@ -0,0 +1,37 @@
+#pragma once
+
+// Compile-time policies of the MVCC engine. Each SharedMemory instantiation
+// is specialized on one of each, so only adaptive versioning costs a branch
+// at run time.
+
+// When writes become visible in shared memory:
+// - lazy: buffered in the write set, locked and published at commit
+// - eager: locked at write time and installed in place, undone on abort
+// - adaptive: lazy, eager or serialized, switched at run time by ModeSwitch
+struct LazyVersioning {
+  static constexpr bool eager = false;
+  static constexpr bool adaptive = false;
+};
+struct EagerVersioning {
+  static constexpr bool eager = true;
+  static constexpr bool adaptive = false;
+};
+struct AdaptiveVersioning {
+  static constexpr bool eager = false;
+  static constexpr bool adaptive = true;
+};
+
+// Which clock a transaction starts from, which also decides reclamation:
+// - global: pin the latest commit descriptor under descriptor_mutex; versions
+//   are freed when the last descriptor referencing them is released
+// - per-thread: announce the start time in a per-thread slot, which only reads
+//   the shared clock; versions are freed once every announced clock passed
+// Either way commits take their times from the one clock, under
+// descriptor_mutex: per-thread clocks only take begin_tx off the mutex and
+// the descriptor's refcount, the commit side is left to commit combining.
+struct GlobalClock {
+  static constexpr bool per_thread = false;
+};
+struct PerThreadClock {
+  static constexpr bool per_thread = true;
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <thread>
+
+#include "stats.hpp"
+#include "thread-slot.hpp"
+#include "tm-ext.hpp"
+
+inline const char* to_string(Priority priority) noexcept {
+  switch (priority) {
+  case Priority::low:
+    return "low";
+  case Priority::normal:
+    return "normal";
+  case Priority::high:
+    return "high";
+  }
+  return "?";
+}
+
+// Transactions by priority class: how many high-priority ones are running,
+// when each thread's transaction first tried, for latency budgets that span
+// retries, and with statistics how long each class took to commit.
+class PriorityClasses {
+public:
+  // Busy lock rounds of a favoured transaction, in TM_LOCK_SPINs
+  static constexpr unsigned FAVOURED_SPIN = 16;
+  // Longest a low-priority transaction without a budget is deferred, in ns
+  static constexpr std::uint64_t DEFER_LIMIT = 1'000'000;
+
+  PriorityClasses()
+      : attempts(std::make_unique<Attempt[]>(ThreadSlot::MAX_THREADS)) {}
+
+  [[nodiscard]] static std::uint64_t now() noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // When the transaction from `call_site` first tried: the start of the
+  // previous attempt on this thread if it aborted, otherwise `now`.
+  // Approximate when a thread interleaves transactions (coroutines).
+  std::uint64_t first_attempt(std::size_t slot, std::size_t call_site,
+                              std::uint64_t now) const noexcept {
+    if (slot == ThreadSlot::NONE) {
+      return now;
+    }
+    auto& attempt = attempts[slot];
+    return attempt.started != 0 && attempt.call_site == call_site
+               ? attempt.started
+               : now;
+  }
+
+  // Must follow every first_attempt(), once the transaction committed or
+  // aborted
+  void ended(std::size_t slot, std::size_t call_site, Priority priority,
+             std::uint64_t started, bool committed, bool record) noexcept {
+    if (slot != ThreadSlot::NONE) {
+      attempts[slot] = {call_site, committed ? 0 : started};
+    }
+    if (committed && record) {
+      latencies[static_cast<std::size_t>(priority)].record(now() - started);
+    }
+  }
+
+  void enter_high() noexcept {
+    high_running.fetch_add(1, std::memory_order_relaxed);
+  }
+  void leave_high() noexcept {
+    high_running.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // Lets the high-priority transactions running finish first, until
+  // `deadline`
+  void defer(std::uint64_t deadline) noexcept {
+    if (high_running.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    deferred.fetch_add(1, std::memory_order_relaxed);
+    while (high_running.load(std::memory_order_relaxed) != 0 &&
+           now() < deadline) {
+      std::this_thread::yield();
+    }
+  }
+
+  void print(std::ostream& out) const {
+    out << "deferred=" << deferred.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < latencies.size(); ++i) {
+      auto& latency = latencies[i];
+      if (latency.count() == 0) {
+        continue;
+      }
+      out << ' ' << to_string(static_cast<Priority>(i))
+          << "(commits=" << latency.count()
+          << " p50=" << latency.percentile(0.5)
+          << "ns p90=" << latency.percentile(0.9)
+          << "ns p99=" << latency.percentile(0.99)
+          << "ns p99.9=" << latency.percentile(0.999) << "ns)";
+    }
+    out << '\n';
+  }
+
+private:
+  // Only ever touched by the thread in the slot
+  struct alignas(64) Attempt {
+    std::size_t call_site = 0;
+    // Start of the first attempt of a transaction that aborted, or 0
+    std::uint64_t started = 0;
+  };
+
+  std::unique_ptr<Attempt[]> attempts;
+  alignas(64) std::atomic<std::uint_fast32_t> high_running{0};
+  std::atomic<std::uint_fast64_t> deferred{0};
+  std::array<LatencyHistogram, 3> latencies;
+};
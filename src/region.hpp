@@ -0,0 +1,52 @@
+#pragma once
+
+#include <variant>
+
+#include "norec-memory.hpp"
+#include "shared-memory.hpp"
+
+// A shared memory region, implemented by whichever engine was selected at
+// creation. Entry points dispatch on it once per call, after which the
+// engine's code runs fully specialized.
+using Region = std::variant<SharedMemory<LazyVersioning, GlobalClock>,
+                            SharedMemory<LazyVersioning, PerThreadClock>,
+                            SharedMemory<EagerVersioning, GlobalClock>,
+                            SharedMemory<EagerVersioning, PerThreadClock>,
+                            SharedMemory<AdaptiveVersioning, GlobalClock>,
+                            SharedMemory<AdaptiveVersioning, PerThreadClock>,
+                            NorecMemory>;
+
+template <typename Memory>
+Region* make_region(std::size_t size, std::size_t align, Config config) {
+  return new Region(std::in_place_type<Memory>, size, align, config);
+}
+
+template <typename Versioning>
+Region* make_mvcc_region(std::size_t size, std::size_t align, Config config) {
+  if (config.clock == Config::Clock::thread) {
+    return make_region<SharedMemory<Versioning, PerThreadClock>>(size, align,
+                                                                 config);
+  }
+  return make_region<SharedMemory<Versioning, GlobalClock>>(size, align,
+                                                            config);
+}
+
+// Picks the engine, and its policies, that `config` asks for
+inline Region* make_region(std::size_t size, std::size_t align,
+                           Config config) {
+  switch (config.engine) {
+  case Config::Engine::norec:
+    return make_region<NorecMemory>(size, align, config);
+  case Config::Engine::mvcc:
+    break;
+  }
+  switch (config.versioning) {
+  case Config::Versioning::eager:
+    return make_mvcc_region<EagerVersioning>(size, align, config);
+  case Config::Versioning::adaptive:
+    return make_mvcc_region<AdaptiveVersioning>(size, align, config);
+  case Config::Versioning::lazy:
+    break;
+  }
+  return make_mvcc_region<LazyVersioning>(size, align, config);
+}
@@ -11,8 +11,12 @@ std::uint8_t log2(std::uint8_t x) {
   return count;
 }
 
-SegmentAllocator::SegmentAllocator(std::size_t size, std::size_t align)
-    : align(align), shift_offset(log2(align)) {
+SegmentAllocator::SegmentAllocator(std::size_t size, std::size_t align,
+                                   std::size_t page_from)
+    : align(align), shift_offset(log2(align)), page_from(page_from),
+      base(FIRST_BASE +
+           next_range.fetch_add(1, std::memory_order_relaxed) % RANGES *
+               RANGE) {
   // std::cout << "Align: " << align
   //          << ", amount to shift accesses by: " << shift_offset << '\n';
   all_segments = std::make_unique<SharedSegment[]>(MAX_SEGMENTS);
@@ -25,6 +29,9 @@ SegmentAllocator::SegmentAllocator(std::size_t size, std::size_t align)
 }
 
 bool SegmentAllocator::allocate(std::size_t size, ObjectId* addr) {
+  if (size > ObjectId::OFFSET_MASK + 1) {
+    return false;
+  }
   // std::cout << "Acquiring mutex\n";
   std::unique_lock lock(mutex);
   // std::cout << "#Available segments: " << available.size() << '\n';
@@ -33,23 +40,40 @@ bool SegmentAllocator::allocate(std::size_t size, ObjectId* addr) {
   }
   auto next = available.back();
   available.pop_back();
-  all_segments[next].allocate(size, align);
+  all_segments[next].allocate(size, align,
+                              page_from != 0 && size >= page_from);
 
-  *addr = ObjectId{next, 1, 0};
+  *addr = ObjectId::of(next, 0);
+  live.insert(to_address(*addr), size);
   return true;
 }
 
 SharedSegment& SegmentAllocator::find_segment(ObjectId addr) {
-  return all_segments[addr.segment];
+  return all_segments[addr.segment()];
+}
+
+void SegmentAllocator::free(ObjectId addr) {
+  std::unique_lock lock(mutex);
+  all_segments[addr.segment()].deallocate();
+  available.push_back(addr.segment());
+  live.remove(to_address(addr));
 }
 
-Object& SegmentAllocator::find(ObjectId addr) {
-  const auto segm_offset = addr.offset >> shift_offset;
-  return find_segment(addr)[segm_offset];
+bool SegmentAllocator::locked(ObjectId addr) {
+  // Segments are neither freed nor switching lock tables under mutex. While
+  // someone else holds it, the lock counts as held: its waiter only checks
+  // again later.
+  std::unique_lock lock(mutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    return true;
+  }
+  auto& segment = all_segments[addr.segment()];
+  return addr.offset() < segment.size_bytes() &&
+         segment.lock(addr.offset() >> shift_offset).locked();
 }
 
-void SegmentAllocator::free(ObjectId addr) {
+bool SegmentAllocator::is_segment_start(void* addr) {
   std::unique_lock lock(mutex);
-  all_segments[addr.segment].deallocate();
-  available.push_back(addr.segment);
+  auto found = live.find(addr);
+  return found != live.end() && found->first == addr;
 }
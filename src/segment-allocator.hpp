@@ -1,33 +1,127 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <iostream>
 #include <mutex>
 #include <vector>
 
+#include "segment-tree.hpp"
 #include "shared-segment.hpp"
 
 class SegmentAllocator {
 public:
-  SegmentAllocator(std::size_t size, std::size_t align);
+  // Segments of at least `page_from` bytes are paged, none if it's 0
+  SegmentAllocator(std::size_t size, std::size_t align,
+                   std::size_t page_from = 0);
+
+  SegmentAllocator(const SegmentAllocator&) = delete;
+  SegmentAllocator& operator=(const SegmentAllocator&) = delete;
 
   bool allocate(std::size_t size, ObjectId* addr);
   void free(ObjectId addr);
 
-  Object& find(ObjectId addr);
+  // Versions of the word at `addr`, which may hold its whole page
+  Object& find(ObjectId addr) noexcept {
+    return all_segments[addr.segment()].unit_of(addr.offset());
+  }
+  const Object& find(ObjectId addr) const noexcept {
+    return all_segments[addr.segment()].unit_of(addr.offset());
+  }
   SharedSegment& find_segment(ObjectId addr);
 
+  // Where the word at `addr` lies in the versions find() returns
+  [[nodiscard]] std::size_t unit_offset(ObjectId addr) const noexcept {
+    return all_segments[addr.segment()].offset_in_unit(addr.offset());
+  }
+  [[nodiscard]] bool paged(ObjectId addr) const noexcept {
+    return all_segments[addr.segment()].paged();
+  }
+
+  // Lock of the word at `addr`, possibly shared with its neighbours
+  VersionedLock& lock_of(ObjectId addr) noexcept {
+    return all_segments[addr.segment()].lock(addr.offset() >> shift_offset);
+  }
+  template <std::size_t Align> VersionedLock& lock_of(ObjectId addr) noexcept {
+    if constexpr (Align == 0) {
+      return lock_of(addr);
+    } else {
+      return all_segments[addr.segment()].lock(addr.offset() / Align);
+    }
+  }
+  // Whether that lock is shared
+  [[nodiscard]] bool coarse(ObjectId addr) const noexcept {
+    return all_segments[addr.segment()].coarse(addr.offset() >> shift_offset);
+  }
+  // Whether a granularity switch holds it for the time being
+  [[nodiscard]] bool switching(ObjectId addr) const noexcept {
+    return all_segments[addr.segment()].switching(addr.offset() >>
+                                                  shift_offset);
+  }
+  // Counts a conflict on the word at `addr`, for its lock's granularity
+  void conflict(ObjectId addr) noexcept {
+    all_segments[addr.segment()].conflict(addr.offset() >> shift_offset);
+  }
+
+  // Calls `func` on the next live segment in turn, which can't be freed
+  // meanwhile. Does nothing if someone else is allocating or freeing.
+  template <typename Func> void visit_next_segment(Func&& func) {
+    std::unique_lock lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      return;
+    }
+    for (std::size_t i = 0; i < MAX_SEGMENTS; ++i) {
+      auto& segment = all_segments[next_visit];
+      next_visit = (next_visit + 1) % MAX_SEGMENTS;
+      if (segment.size_bytes() != 0) {
+        func(segment);
+        return;
+      }
+    }
+  }
+
   const SharedSegment& first_segment() const noexcept {
     return all_segments[0];
   }
 
-  ObjectId first_addr() const noexcept { return ObjectId{0, 1, 0}; }
+  ObjectId first_addr() const noexcept { return ObjectId::of(0, 0); }
+
+  // Shared addresses lie in a range of their own for the region, segment
+  // after segment, so converting them is a subtraction
+  [[nodiscard]] ObjectId to_object_id(const void* addr) const noexcept {
+    return ObjectId{reinterpret_cast<std::uintptr_t>(addr) - base};
+  }
+
+  [[nodiscard]] void* to_address(ObjectId id) const noexcept {
+    return reinterpret_cast<void*>(base + id.bits);
+  }
+
+  // Whether `addr` is the start of a live segment
+  bool is_segment_start(void* addr);
+  // Whether the lock of the word at `addr` is held, false once its segment
+  // was freed. Safe from any thread, unlike lock_of().
+  bool locked(ObjectId addr);
 
 private:
   static constexpr std::uint8_t MAX_SEGMENTS = 255;
-  std::size_t align, shift_offset = 0;
+  // Addresses are never dereferenced, so nothing is mapped for them: each
+  // region takes the next range of non-canonical addresses from FIRST_BASE
+  // on. Those can't clash with real memory, nor with another region's until
+  // some two million regions were created.
+  static constexpr std::uintptr_t RANGE = std::uintptr_t(MAX_SEGMENTS + 1)
+                                          << ObjectId::SEGMENT_SHIFT;
+  static constexpr std::uintptr_t FIRST_BASE = 1ul << 55;
+  static constexpr std::uintptr_t RANGES = ((1ul << 63) - FIRST_BASE) / RANGE;
+  static inline std::atomic<std::uintptr_t> next_range{0};
+
+  std::size_t align, shift_offset = 0, page_from;
+  std::uintptr_t base;
 
   std::mutex mutex;
+  // Live segments by address, under mutex
+  RegionTree<void*> live;
   std::unique_ptr<SharedSegment[]> all_segments;
   std::vector<std::uint8_t> available;
+  // Segment visit_next_segment() looks at first, under mutex
+  std::size_t next_visit = 0;
 };
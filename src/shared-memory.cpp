@@ -1,6 +1,9 @@
 #include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <thread>
 #include <unordered_set>
 
 #include "shared-memory.hpp"
@@ -11,100 +14,1015 @@ static std::unique_ptr<char[]> clone(const char* word, std::size_t align) {
   return copy;
 }
 
-SharedMemory::~SharedMemory() noexcept { unref(current.load()); }
+template <typename Versioning, typename Clock>
+SharedMemory<Versioning, Clock>::SharedMemory(std::size_t size,
+                                              std::size_t align,
+                                              Config config) noexcept
+    : align(align), config(config), stats(config.print_stats),
+      allocator(size, align, config.page_segments) {
+  if constexpr (Clock::per_thread) {
+    thread_clocks = std::make_unique<ThreadClock[]>(ThreadSlot::MAX_THREADS);
+    oldest = current.load();
+    ref(oldest);
+  }
+  threads = std::make_unique<ThreadState[]>(ThreadSlot::MAX_THREADS);
+}
+
+template <typename Versioning, typename Clock>
+SharedMemory<Versioning, Clock>::~SharedMemory() noexcept {
+  if (stats.active()) {
+    stats.print(std::cerr);
+    if constexpr (Versioning::adaptive) {
+      mode_switch.print(std::cerr);
+    }
+    if (config.schedule) {
+      scheduler.print(std::cerr);
+    }
+    priorities.print(std::cerr);
+  }
+  unref(current.load());
+  unref(oldest);
+}
 
-Transaction SharedMemory::begin_tx(bool is_ro) noexcept {
-  Transaction tx;
+template <typename Versioning, typename Clock>
+MvccTransaction
+SharedMemory<Versioning, Clock>::begin_tx(bool is_ro, const void* call_site,
+                                          Priority priority,
+                                          std::uint64_t budget,
+                                          bool suspendable) noexcept {
+  MvccTransaction tx;
+  tx.suspendable = suspendable;
+  // Slot 0 gathers the transactions of unknown sites, never inferred
+  if (call_site != nullptr) {
+    tx.call_site =
+        1 + std::hash<const void*>{}(call_site) % (CALL_SITES - 1);
+  }
+  if (!is_ro && tx.call_site != 0 &&
+      read_only_streaks[tx.call_site].load(std::memory_order_relaxed) >=
+          READ_ONLY_STREAK) {
+    is_ro = true;
+    tx.inferred_ro = true;
+  }
   tx.is_ro = is_ro;
+  tx.priority = priority;
+  bool over_budget = false;
+  if (stats.active() || budget != 0 || priority == Priority::low) {
+    auto now = PriorityClasses::now();
+    tx.timed = true;
+    tx.started = priorities.first_attempt(ThreadSlot::index(), tx.call_site,
+                                          now);
+    over_budget = budget != 0 && now - tx.started > budget;
+  }
+  // Before taking the start time, so that a serialized transaction starts
+  // after the previous one committed. A retry past its budget is favoured
+  // from then on, whatever its class.
+  if (!is_ro && (priority == Priority::high || over_budget)) {
+    priorities.enter_high();
+    tx.favoured = true;
+  } else if (!is_ro && priority == Priority::low) {
+    priorities.defer(tx.started +
+                     (budget != 0 ? budget : PriorityClasses::DEFER_LIMIT));
+  }
+  // Favoured transactions don't queue behind anyone, and suspendable ones
+  // would hold the queues while suspended
+  if (!is_ro && config.schedule && !tx.favoured && !suspendable) {
+    tx.queues = scheduler.enter(ThreadSlot::index());
+    tx.scheduled = true;
+  }
+  if constexpr (Versioning::adaptive) {
+    if (!is_ro) {
+      tx.mode = mode_switch.enter(ThreadSlot::index(), !suspendable);
+      tx.gated = true;
+    }
+  }
+  pin(tx);
+  return tx;
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::pin(MvccTransaction& tx) noexcept {
+  if constexpr (Clock::per_thread) {
+    if (announce(tx)) {
+      return;
+    }
+  }
+
   TransactionDescriptor* start_point;
   {
     std::unique_lock lock(descriptor_mutex);
     start_point = current.load(std::memory_order_acquire);
     ref(start_point);
+    // Single-word commits advance it without descriptor_mutex
+    tx.start_time = clock.load(std::memory_order_acquire);
   }
 
-  tx.start_time = start_point->commit_time;
   tx.start_point = start_point;
+}
+
+template <typename Versioning, typename Clock>
+MvccTransaction
+SharedMemory<Versioning, Clock>::begin_si(const void* call_site) noexcept {
+  // Holds on to start_time's snapshot like any transaction, through its
+  // descriptor or announced clock
+  auto tx = begin_tx(false, call_site);
+  tx.snapshot_isolation = true;
+  return tx;
+}
+
+template <typename Versioning, typename Clock>
+SharedSnapshot* SharedMemory<Versioning, Clock>::export_snapshot(
+    const MvccTransaction& tx) noexcept {
+  if (!tx.is_ro) {
+    return nullptr;
+  }
+  std::unique_lock lock(descriptor_mutex);
+  auto* pin = tx.start_point;
+  if (pin == nullptr) {
+    // An announced clock: the pinned descriptors go as far back as the
+    // earliest one, and nothing from the start time on was reclaimed
+    pin = oldest;
+    while (pin->next != nullptr && pin->next->commit_time <= tx.start_time) {
+      pin = pin->next;
+    }
+  }
+  ref(pin);
+  return new SharedSnapshot{tx.start_time, pin};
+}
+
+template <typename Versioning, typename Clock>
+MvccTransaction SharedMemory<Versioning, Clock>::begin_at(
+    const SharedSnapshot& snapshot) noexcept {
+  MvccTransaction tx;
+  tx.is_ro = true;
+  // Already pinned by the snapshot, which outlives the transaction
+  ref(snapshot.pin);
+  tx.start_point = snapshot.pin;
+  tx.start_time = snapshot.start_time;
   return tx;
 }
 
-bool SharedMemory::read_word(Transaction& tx, ObjectId src,
-                             char* dst) noexcept {
-  // std::cout << "Reading word " << src.offset << ' ' << +src.segment << '\n';
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::release_snapshot(
+    SharedSnapshot* snapshot) noexcept {
+  unref(snapshot->pin);
+  delete snapshot;
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::announce(MvccTransaction& tx) noexcept {
+  const auto slot = ThreadSlot::index();
+  if (slot == ThreadSlot::NONE) {
+    return false;
+  }
+  auto& announced = thread_clocks[slot].announced;
+  if (announced.load(std::memory_order_relaxed) != ThreadClock::IDLE) {
+    // This thread is already running a transaction in this region
+    return false;
+  }
+
+  // Re-check the clock after announcing: a reclamation scan that missed our
+  // announcement must have run before the clock we end up starting from
+  auto now = clock.load();
+  while (true) {
+    announced.store(now);
+    auto again = clock.load();
+    if (again == now) {
+      break;
+    }
+    now = again;
+  }
+  tx.start_time = now;
+  tx.clock_slot = slot;
+  return true;
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::release(MvccTransaction& tx) noexcept {
+  if (tx.clock_slot != ThreadSlot::NONE) {
+    thread_clocks[tx.clock_slot].announced.store(ThreadClock::IDLE,
+                                                 std::memory_order_release);
+  }
+  unref(tx.start_point);
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::read(MvccTransaction& tx,
+                                           const void* source,
+                                           std::size_t size,
+                                           void* target) noexcept {
+  auto* dest = reinterpret_cast<char*>(target);
+  auto start = allocator.to_object_id(source);
+  // std::cout << "Original source ptr=" << source << '\n';
+  // std::cout << "Reading :: size=" << size << ", start=" << start.offset()
+  //          << ", segment=" << +start.segment() << ", align=" << align
+  //          << '\n';
+  switch (align) {
+  case 1:
+    return read_words<1>(tx, start, size, dest);
+  case 2:
+    return read_words<2>(tx, start, size, dest);
+  case 4:
+    return read_words<4>(tx, start, size, dest);
+  case 8:
+    return read_words<8>(tx, start, size, dest);
+  case 16:
+    return read_words<16>(tx, start, size, dest);
+  case 32:
+    return read_words<32>(tx, start, size, dest);
+  case 64:
+    return read_words<64>(tx, start, size, dest);
+  default:
+    return read_words<0>(tx, start, size, dest);
+  }
+}
+
+template <typename Versioning, typename Clock>
+template <std::size_t Align>
+bool SharedMemory<Versioning, Clock>::read_words(MvccTransaction& tx,
+                                                 ObjectId start,
+                                                 std::size_t size,
+                                                 char* dest) noexcept {
+  if (tx.is_ro && allocator.paged(start)) {
+    read_pages(tx, start, size, dest);
+    return true;
+  }
+  const auto word = word_size<Align>();
+  for (std::size_t offset = 0; offset < size; offset += word) {
+    if (!read_word<Align>(tx, start + offset, dest + offset)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::read_pages(const MvccTransaction& tx,
+                                                 ObjectId start,
+                                                 std::size_t size,
+                                                 char* dest) const noexcept {
+  // One copy per page of the snapshot, rather than one lookup per word
+  for (std::size_t done = 0; done < size;) {
+    auto addr = start + done;
+    auto offset = allocator.unit_offset(addr);
+    auto chunk = std::min(size - done, SharedSegment::PAGE_SIZE - offset);
+    snapshot(tx, allocator.find(addr))->read(dest + done, chunk, offset);
+    done += chunk;
+  }
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::write(MvccTransaction& tx,
+                                            const void* source,
+                                            std::size_t size,
+                                            void* target) noexcept {
+  const auto* src = reinterpret_cast<const char*>(source);
+  auto start = allocator.to_object_id(target);
+  // std::cout << "Original target ptr=" << target << '\n';
+  // std::cout << "Writing :: size=" << size << ", start=" << start.offset()
+  //           << ", segment=" << +start.segment() << ", align=" << align
+  //           << '\n';
+  switch (align) {
+  case 1:
+    return write_words<1>(tx, src, size, start);
+  case 2:
+    return write_words<2>(tx, src, size, start);
+  case 4:
+    return write_words<4>(tx, src, size, start);
+  case 8:
+    return write_words<8>(tx, src, size, start);
+  case 16:
+    return write_words<16>(tx, src, size, start);
+  case 32:
+    return write_words<32>(tx, src, size, start);
+  case 64:
+    return write_words<64>(tx, src, size, start);
+  default:
+    return write_words<0>(tx, src, size, start);
+  }
+}
+
+template <typename Versioning, typename Clock>
+template <std::size_t Align>
+bool SharedMemory<Versioning, Clock>::write_words(MvccTransaction& tx,
+                                                  const char* src,
+                                                  std::size_t size,
+                                                  ObjectId start) noexcept {
+  const auto word = word_size<Align>();
+  for (std::size_t offset = 0; offset < size; offset += word) {
+    if (!write_word<Align>(tx, src + offset, start + offset)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::read_many(MvccTransaction& tx,
+                                                const Access* accesses,
+                                                std::size_t count) noexcept {
+  switch (align) {
+  case 1:
+    return read_many_words<1>(tx, accesses, count);
+  case 2:
+    return read_many_words<2>(tx, accesses, count);
+  case 4:
+    return read_many_words<4>(tx, accesses, count);
+  case 8:
+    return read_many_words<8>(tx, accesses, count);
+  case 16:
+    return read_many_words<16>(tx, accesses, count);
+  case 32:
+    return read_many_words<32>(tx, accesses, count);
+  case 64:
+    return read_many_words<64>(tx, accesses, count);
+  default:
+    return read_many_words<0>(tx, accesses, count);
+  }
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::write_many(MvccTransaction& tx,
+                                                 const Access* accesses,
+                                                 std::size_t count) noexcept {
+  switch (align) {
+  case 1:
+    return write_many_words<1>(tx, accesses, count);
+  case 2:
+    return write_many_words<2>(tx, accesses, count);
+  case 4:
+    return write_many_words<4>(tx, accesses, count);
+  case 8:
+    return write_many_words<8>(tx, accesses, count);
+  case 16:
+    return write_many_words<16>(tx, accesses, count);
+  case 32:
+    return write_many_words<32>(tx, accesses, count);
+  case 64:
+    return write_many_words<64>(tx, accesses, count);
+  default:
+    return write_many_words<0>(tx, accesses, count);
+  }
+}
+
+template <typename Versioning, typename Clock>
+template <std::size_t Align>
+void SharedMemory<Versioning, Clock>::prefetch(const Access* accesses,
+                                               std::size_t count) noexcept {
+  // Only each range's first word: the hardware prefetcher follows the rest
+  // of a range, and looking them all up here would double the work
+  for (std::size_t i = 0; i < count; ++i) {
+    auto start = allocator.to_object_id(accesses[i].shared);
+    __builtin_prefetch(&allocator.find(start));
+    __builtin_prefetch(&allocator.lock_of<Align>(start));
+  }
+}
+
+template <typename Versioning, typename Clock>
+template <std::size_t Align>
+bool SharedMemory<Versioning, Clock>::read_many_words(
+    MvccTransaction& tx, const Access* accesses, std::size_t count) noexcept {
+  prefetch<Align>(accesses, count);
+  for (std::size_t i = 0; i < count; ++i) {
+    auto& access = accesses[i];
+    if (!read_words<Align>(tx, allocator.to_object_id(access.shared),
+                           access.size, static_cast<char*>(access.buffer))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename Versioning, typename Clock>
+template <std::size_t Align>
+bool SharedMemory<Versioning, Clock>::write_many_words(
+    MvccTransaction& tx, const Access* accesses, std::size_t count) noexcept {
+  prefetch<Align>(accesses, count);
+  for (std::size_t i = 0; i < count; ++i) {
+    auto& access = accesses[i];
+    if (!write_words<Align>(tx, static_cast<const char*>(access.buffer),
+                            access.size,
+                            allocator.to_object_id(access.shared))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename Versioning, typename Clock>
+template <std::size_t Align>
+bool SharedMemory<Versioning, Clock>::read_word(MvccTransaction& tx,
+                                                ObjectId src,
+                                                char* dst) noexcept {
+  const auto word = word_size<Align>();
+  // std::cout << "Reading word " << src.offset() << ' ' << +src.segment()
+  //           << '\n';
   auto& obj = allocator.find(src);
+  const auto offset = allocator.unit_offset(src);
   if (tx.is_ro) {
-    read_word_readonly(tx, obj, dst);
+    read_word_readonly<Align>(tx, obj, offset, dst);
+    return true;
+  }
+
+  // Private segments are accessed in place, without any bookkeeping
+  if (tx.owns_segment(src)) {
+    obj.latest.load(std::memory_order_relaxed)->read(dst, word, offset);
     return true;
   }
 
   if (auto entry = tx.find_write_entry(src)) {
-    std::memcpy(dst, entry->written.get(), align);
+    if (entry->delta) {
+      return read_delta<Align>(tx, *entry, dst);
+    }
+    std::memcpy(dst, entry->written.get(), word);
     return true;
   }
 
-  auto latest = obj.latest.load(std::memory_order_acquire);
-  if (!obj.lock.validate(tx.start_time)) {
-    abort(tx);
+  if (tx.snapshot_isolation) {
+    if (auto undo = tx.find_undo_entry(src)) {
+      undo->pending->read(dst, word);
+    } else {
+      read_word_readonly<Align>(tx, obj, offset, dst);
+    }
+    return true;
+  }
+
+  if (eager(tx)) {
+    return read_word_eager<Align>(tx, src, obj, dst);
+  }
+
+  const ObjectVersion* latest = obj.latest.load(std::memory_order_acquire);
+  // Eager transactions from before a mode switch may still be running: their
+  // pending versions may be undone even after the lock validated
+  bool pending = false;
+  if constexpr (Versioning::adaptive) {
+    pending = latest->version.load(std::memory_order_acquire) ==
+              ObjectVersion::PENDING;
+  }
+  if (pending || !allocator.lock_of<Align>(src).validate(tx.start_time)) {
+    if (!unchanged(tx, src, obj, VersionedLock::ANY_VERSION)) {
+      stats.count(stats.validation_aborts);
+      contended(tx, src);
+      conflict(tx);
+      return false;
+    }
+    latest = snapshot(tx, obj);
+  }
+  tx.read_set.push_back({src, &obj});
+  latest->read(dst, word, offset);
+  return true;
+}
+
+template <typename Versioning, typename Clock>
+template <std::size_t Align>
+bool SharedMemory<Versioning, Clock>::read_word_eager(MvccTransaction& tx,
+                                                      ObjectId src, Object& obj,
+                                                      char* dst) noexcept {
+  const auto word = word_size<Align>();
+  const ObjectVersion* latest = obj.latest.load(std::memory_order_acquire);
+  if (latest->version.load(std::memory_order_acquire) ==
+      ObjectVersion::PENDING) {
+    // Either our own write, or somebody else's uncommitted one
+    if (auto entry = tx.find_undo_entry(src)) {
+      entry->pending->read(dst, word);
+      return true;
+    }
+    stats.count(stats.validation_aborts);
+    contended(tx, src);
+    conflict(tx);
     return false;
   }
-  tx.read_set.push_back({src, obj});
-  latest->read(dst, align);
+  if (!allocator.lock_of<Align>(src).validate(tx.start_time)) {
+    if (!unchanged(tx, src, obj, VersionedLock::ANY_VERSION)) {
+      stats.count(stats.validation_aborts);
+      contended(tx, src);
+      conflict(tx);
+      return false;
+    }
+    latest = snapshot(tx, obj);
+  }
+  tx.read_set.push_back({src, &obj});
+  latest->read(dst, word, allocator.unit_offset(src));
   return true;
 }
 
-void SharedMemory::read_word_readonly(const Transaction& tx, const Object& obj,
-                                      char* dst) const noexcept {
+template <typename Versioning, typename Clock>
+template <std::size_t Align>
+void SharedMemory<Versioning, Clock>::read_word_readonly(
+    const MvccTransaction& tx, const Object& obj, std::size_t offset,
+    char* dst) const noexcept {
+  snapshot(tx, obj)->read(dst, word_size<Align>(), offset);
+}
+
+template <typename Versioning, typename Clock>
+const ObjectVersion*
+SharedMemory<Versioning, Clock>::snapshot(const MvccTransaction& tx,
+                                          const Object& obj) const noexcept {
   auto ver = obj.latest.load(std::memory_order_acquire);
   while (ver->version > tx.start_time) {
     ver = ver->earlier;
   }
-  ver->read(dst, align);
+  return ver;
 }
 
-bool SharedMemory::write_word(Transaction& tx, const char* src,
-                              ObjectId dst) noexcept {
-  // std::cout << "Writing word " << dst.offset << ' ' << +dst.segment << '\n';
-  if (auto entry = tx.find_write_entry(dst)) {
-    std::memcpy(entry->written.get(), src, align);
+template <typename Versioning, typename Clock>
+const void*
+SharedMemory<Versioning, Clock>::read_view(MvccTransaction& tx,
+                                           const void* source,
+                                           std::size_t size) noexcept {
+  // A committed version never changes, and is only reclaimed once nobody who
+  // started before it was replaced is left, so it outlives the transaction.
+  // Pages hold many words in one version.
+  auto addr = allocator.to_object_id(source);
+  auto offset = allocator.unit_offset(addr);
+  if (tx.is_ro &&
+      offset + size <= allocator.find_segment(addr).unit_size()) {
+    return snapshot(tx, allocator.find(addr))->buf.get() + offset;
+  }
+
+  // Other words live in separate versions, and a read-write transaction
+  // must see its own writes: copy into the transaction's arena, a page at a
+  // time for read-only transactions on paged segments
+  auto* chunk = tx.views.allocate(size);
+  if (!read(tx, source, size, chunk)) {
+    return nullptr;
+  }
+  return chunk;
+}
+
+template <typename Versioning, typename Clock>
+template <std::size_t Align>
+bool SharedMemory<Versioning, Clock>::write_word(MvccTransaction& tx,
+                                                 const char* src,
+                                                 ObjectId dst) noexcept {
+  const auto word = word_size<Align>();
+  // std::cout << "Writing word " << dst.offset() << ' ' << +dst.segment()
+  //           << '\n';
+  if (!writable(tx)) {
+    return false;
+  }
+
+  // Nobody else can see a segment we allocated until we commit, and the
+  // commit's release of descriptor_mutex and our locks publishes it all
+  if (tx.owns_segment(dst)) {
+    auto& obj = allocator.find(dst);
+    auto* word_ptr = obj.latest.load(std::memory_order_relaxed)->buf.get() +
+                     allocator.unit_offset(dst);
+    save_word(tx, word_ptr);
+    std::memcpy(word_ptr, src, word);
+    return true;
+  }
+
+  auto entry = tx.find_write_entry(dst);
+  if (entry != nullptr && entry->delta) {
+    // The written value replaces whatever was added before
+    drop_write_entry(tx, *entry);
+    entry = nullptr;
+  }
+
+  // Pages are only copied at commit: their writes are buffered in any mode
+  if (eager(tx) && !allocator.paged(dst)) {
+    return write_word_eager<Align>(tx, src, dst);
+  }
+
+  if (entry != nullptr) {
+    save_entry(tx, *entry);
+    std::memcpy(entry->written.get(), src, word);
     return true;
   }
 
   auto& obj = allocator.find(dst);
-  auto written = clone(src, align);
-  tx.write_set.push_back({dst, obj, std::move(written)});
+  auto written = clone(src, word);
+  tx.write_set.push_back({dst, &obj, std::move(written)});
   return true;
 }
 
-bool SharedMemory::allocate(Transaction& tx, std::size_t size,
-                            ObjectId* dest) noexcept {
-  auto success = allocator.allocate(size, dest);
-  if (success) {
-    tx.alloc_set.push_back(*dest);
+template <typename Versioning, typename Clock>
+template <std::size_t Align>
+bool SharedMemory<Versioning, Clock>::read_delta(
+    MvccTransaction& tx, MvccTransaction::WriteEntry& entry,
+    char* dst) noexcept {
+  // The transaction now depends on the word's value: read it like any other
+  // word, and write the sum back like any other write
+  auto addr = entry.addr;
+  auto delta = *entry.delta;
+  drop_write_entry(tx, entry);
+  if (!read_word<Align>(tx, addr, dst)) {
+    return false;
+  }
+  if (!delta.apply(dst, word_size<Align>())) {
+    stats.count(stats.escrow_aborts);
+    conflict(tx);
+    return false;
+  }
+  return write_word<Align>(tx, dst, addr);
+}
+
+template <typename Versioning, typename Clock>
+template <std::size_t Align>
+bool SharedMemory<Versioning, Clock>::write_word_eager(MvccTransaction& tx,
+                                                       const char* src,
+                                                       ObjectId dst) noexcept {
+  const auto word = word_size<Align>();
+  if (auto entry = tx.find_undo_entry(dst)) {
+    save_word(tx, entry->pending->buf.get());
+    entry->pending->write(src, word);
+    return true;
+  }
+
+  // Storing the value the word holds only depends on it staying there, like
+  // a read: readers then don't abort on a pending version of it
+  auto& obj = allocator.find(dst);
+  auto& lock = allocator.lock_of<Align>(dst);
+  auto* latest = obj.latest.load(std::memory_order_acquire);
+  if (latest->version.load(std::memory_order_acquire) !=
+          ObjectVersion::PENDING &&
+      std::memcmp(latest->buf.get(), src, word) == 0 &&
+      lock.validate(tx.start_time)) {
+    tx.read_set.push_back({dst, &obj});
+    tx.silent_stores = true;
+    stats.count(stats.silent_stores);
+    return true;
+  }
+
+  // A neighbour written before may hold the word's lock already
+  bool owns_lock = !holds(tx, dst, lock);
+  bool locked = owns_lock ? lock.try_lock(tx.start_time, lock_spin(tx)) ||
+                                lock_unchanged(tx, lock, dst, obj)
+                          : lock.version() <= tx.start_time ||
+                                unchanged_locked(tx, dst, obj);
+  if (!locked) {
+    stats.count(stats.lock_aborts);
+    if (replaced(dst, lock)) {
+      stats.count(stats.stale_locks);
+    }
+    contended(tx, dst);
+    conflict(tx);
+    return false;
+  }
+
+  if (owns_lock && tx.eager_slot == ThreadSlot::NONE &&
+      ThreadSlot::index() != ThreadSlot::NONE) {
+    tx.eager_slot = ThreadSlot::index();
+    threads[tx.eager_slot].eager.push_back(&tx);
+  }
+
+  // Readers skip the pending version until it's stamped at commit
+  auto* pending = new ObjectVersion(clone(src, word));
+  pending->version.store(ObjectVersion::PENDING, std::memory_order_relaxed);
+  pending->earlier = obj.latest.load(std::memory_order_acquire);
+  obj.latest.store(pending, std::memory_order_release);
+  tx.log_undo({dst, &obj, pending, &lock, owns_lock});
+  return true;
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::writable(MvccTransaction& tx) noexcept {
+  if (!tx.inferred_ro) {
+    return true;
+  }
+  read_only_streaks[tx.call_site].store(0, std::memory_order_relaxed);
+  stats.count(stats.mispredictions);
+  abort(tx);
+  return false;
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::add(MvccTransaction& tx, void* target,
+                                          const Delta& delta) noexcept {
+  // Only words holding a signed integer can be added to: retrying wouldn't
+  // help, so the whole transaction gives up
+  if (!Delta::applies_to(align)) {
+    abort(tx);
+    return false;
+  }
+  if (!writable(tx)) {
+    return false;
+  }
+
+  // Words nobody else can see before we commit are updated right away
+  auto addr = allocator.to_object_id(target);
+  auto& obj = allocator.find(addr);
+  char* word = nullptr;
+  if (tx.owns_segment(addr)) {
+    word = obj.latest.load(std::memory_order_relaxed)->buf.get() +
+           allocator.unit_offset(addr);
+    save_word(tx, word);
+  } else if (auto undo = tx.find_undo_entry(addr)) {
+    word = undo->pending->buf.get();
+    save_word(tx, word);
+  } else if (auto entry = tx.find_write_entry(addr)) {
+    save_entry(tx, *entry);
+    if (!entry->delta) {
+      word = entry->written.get();
+    } else if (entry->delta->merge(delta)) {
+      return true;
+    }
+  } else {
+    tx.write_set.push_back({addr, &obj, nullptr, delta});
+    return true;
+  }
+
+  if (word != nullptr && delta.apply(word, align)) {
+    return true;
+  }
+  stats.count(stats.escrow_aborts);
+  conflict(tx);
+  return false;
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::allocate(MvccTransaction& tx,
+                                               std::size_t size,
+                                               void** target) noexcept {
+  ObjectId dest;
+  if (!allocator.allocate(size, &dest)) {
+    return false;
   }
-  return success;
+  tx.alloc_set.push_back(dest);
+  *target = allocator.to_address(dest);
+  return true;
 }
 
-void SharedMemory::free(Transaction& tx, ObjectId addr) noexcept {
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::free(MvccTransaction& tx,
+                                           void* target) noexcept {
+#ifdef TM_DEBUG
+  // Takes the allocator's mutex, so only checked in debug builds
+  assert(allocator.is_segment_start(target));
+#endif
+  auto addr = allocator.to_object_id(target);
   if (allocator.find_segment(addr).mark_for_deletion()) {
     tx.free_set.push_back(addr);
   }
 }
 
-static void unlock_all(std::vector<Transaction::WriteEntry>::iterator begin,
-                       std::vector<Transaction::WriteEntry>::iterator end) {
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::atomic_load(const void* source,
+                                                  void* target) noexcept {
+  // A read-only transaction without the transaction: the pin is all that
+  // keeps the version from being reclaimed while copying it
+  MvccTransaction tx;
+  tx.is_ro = true;
+  pin(tx);
+  auto addr = allocator.to_object_id(source);
+  snapshot(tx, allocator.find(addr))
+      ->read(static_cast<char*>(target), align, allocator.unit_offset(addr));
+  release(tx);
+}
+
+template <typename Versioning, typename Clock>
+const void* SharedMemory<Versioning, Clock>::conflict() const noexcept {
+  const auto slot = ThreadSlot::index();
+  if (slot == ThreadSlot::NONE || !threads[slot].conflict) {
+    return nullptr;
+  }
+  return allocator.to_address(*threads[slot].conflict);
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::atomic_store(const void* source,
+                                                   void* target) noexcept {
+  auto addr = allocator.to_object_id(target);
+  auto& obj = allocator.find(addr);
+  TransactionDescriptor* pinned = nullptr;
+  auto* state = enter_atomic(pinned);
+  auto* lock = lock_word(addr, state);
+  if (lock != nullptr) {
+    commit_word(addr, obj, *lock, static_cast<const char*>(source), state);
+  }
+  leave_atomic(state, pinned);
+  return lock != nullptr;
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::atomic_cas(void* target, void* expected,
+                                                 const void* desired) noexcept {
+  auto addr = allocator.to_object_id(target);
+  auto& obj = allocator.find(addr);
+  TransactionDescriptor* pinned = nullptr;
+  auto* state = enter_atomic(pinned);
+  auto* lock = lock_word(addr, state);
+  if (lock == nullptr) {
+    leave_atomic(state, pinned);
+    return false;
+  }
+
+  // Nobody else can replace the latest version while we hold the lock
+  auto* latest = obj.latest.load(std::memory_order_acquire);
+  auto offset = allocator.unit_offset(addr);
+  bool swapped =
+      std::memcmp(latest->buf.get() + offset, expected, align) == 0;
+  if (swapped) {
+    commit_word(addr, obj, *lock, static_cast<const char*>(desired), state);
+  } else {
+    latest->read(static_cast<char*>(expected), align, offset);
+    auto version = lock->version();
+    lock->unlock();
+    await_clock(version);
+  }
+  leave_atomic(state, pinned);
+  return swapped;
+}
+
+template <typename Versioning, typename Clock>
+typename SharedMemory<Versioning, Clock>::ThreadState*
+SharedMemory<Versioning, Clock>::enter_atomic(
+    TransactionDescriptor*& pinned) noexcept {
+  const auto slot = ThreadSlot::index();
+  if (slot == ThreadSlot::NONE) {
+    std::unique_lock lock(descriptor_mutex);
+    pinned = current.load(std::memory_order_acquire);
+    ref(pinned);
+    return nullptr;
+  }
+  // Any clock up to the current one will do, as long as it's re-read after
+  // announcing: a lock table replaced after it was read is then kept
+  auto& state = threads[slot];
+  state.operating.store(clock.load(std::memory_order_relaxed));
+  (void)clock.load();
+  return &state;
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::leave_atomic(
+    ThreadState* state, TransactionDescriptor* pinned) noexcept {
+  if (state != nullptr) {
+    state->operating.store(ThreadClock::IDLE, std::memory_order_release);
+  }
+  unref(pinned);
+}
+
+template <typename Versioning, typename Clock>
+VersionedLock*
+SharedMemory<Versioning, Clock>::lock_word(ObjectId addr,
+                                           const ThreadState* state) noexcept {
+  // Holders are committing, or eager transactions that will end either way,
+  // unless they run on this very thread. Replaced locks stay locked: look it
+  // up each time.
+  while (true) {
+    auto& lock = allocator.lock_of(addr);
+    if (lock.try_lock(VersionedLock::ANY_VERSION, config.lock_spin)) {
+      return &lock;
+    }
+    if (state != nullptr) {
+      for (auto* tx : state->eager) {
+        if (tx->eager_writes(lock) != 0) {
+          return nullptr;
+        }
+      }
+    }
+    std::this_thread::yield();
+  }
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::commit_word(ObjectId addr, Object& obj,
+                                                  VersionedLock& lock,
+                                                  const char* src,
+                                                  ThreadState* state) {
+  // A commit of its own, between two batches: whoever may still read the old
+  // version started before its commit time. Taken once the version is built,
+  // since later commits wait for it to be installed.
+  auto install = [&](ObjectVersion* new_version) {
+    const auto commit_time = next_commit_time();
+    auto* old_version = obj.latest.load(std::memory_order_relaxed);
+    new_version->version.store(commit_time, std::memory_order_relaxed);
+    new_version->earlier = old_version;
+    obj.latest.store(new_version, std::memory_order_release);
+    lock.unlock(commit_time);
+    return std::make_pair(commit_time, old_version);
+  };
+
+  // Words of a page may be written under their own locks: only the page
+  // copy made under descriptor_mutex is sure to hold all of them. Threads
+  // without a slot have no retire list either.
+  if (allocator.paged(addr) || state == nullptr) {
+    std::unique_lock guard(descriptor_mutex);
+    std::unique_ptr<char[]> buf;
+    if (allocator.paged(addr)) {
+      auto* latest = obj.latest.load(std::memory_order_relaxed);
+      buf = clone(latest->buf.get(), SharedSegment::PAGE_SIZE);
+      std::memcpy(buf.get() + allocator.unit_offset(addr), src, align);
+      stats.count(stats.page_copies);
+    } else {
+      buf = clone(src, align);
+    }
+    auto [commit_time, old_version] =
+        install(new ObjectVersion(std::move(buf)));
+    current.load(std::memory_order_relaxed)
+        ->objects_to_delete.emplace_back(old_version);
+    advance_clock(commit_time);
+    if (commit_time % RECLAIM_PERIOD == 0) {
+      collect();
+    }
+    return;
+  }
+
+  auto [commit_time, old_version] =
+      install(new ObjectVersion(clone(src, align)));
+  advance_clock(commit_time);
+  retire(*state, commit_time, old_version);
+  if (commit_time % RECLAIM_PERIOD != 0) {
+    return;
+  }
+  // Whoever holds descriptor_mutex already is combining commits, and
+  // collects at its own commit times
+  if (descriptor_mutex.try_lock()) {
+    collect();
+    descriptor_mutex.unlock();
+  }
+  reclaim(*state);
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::retire(ThreadState& state,
+                                             VersionedLock::Timestamp time,
+                                             ObjectVersion* version) {
+  state.retired.emplace_back(time, version);
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::retire(
+    ThreadState& state, VersionedLock::Timestamp time,
+    std::unique_ptr<VersionedLock[]> table) {
+  state.retired_tables.emplace_back(time, std::move(table));
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::reclaim(ThreadState& state) noexcept {
+  const auto until = reclaimable.load(std::memory_order_acquire);
+  auto free_until = [until](auto& retired) {
+    auto end = retired.begin();
+    while (end != retired.end() && end->first <= until) {
+      ++end;
+    }
+    retired.erase(retired.begin(), end);
+  };
+  free_until(state.retired);
+  free_until(state.retired_tables);
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::await_clock(
+    VersionedLock::Timestamp version) const noexcept {
+  // Words are unlocked before the clock moves to their commit time
+  for (unsigned spin = 0; clock.load() < version; ++spin) {
+    if (spin < config.lock_spin) {
+      cpu_relax();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+static void unlock_all(std::vector<MvccTransaction::WriteEntry>::iterator begin,
+                       std::vector<MvccTransaction::WriteEntry>::iterator end) {
   while (begin != end) {
     // Unlock without changing the version
-    begin->obj.lock.unlock();
+    if (begin->owns_lock) {
+      begin->lock->unlock();
+    }
     begin++;
   }
 }
 
-bool SharedMemory::end_tx(Transaction& tx) noexcept {
+static bool by_address(const MvccTransaction::WriteEntry& a,
+                       const MvccTransaction::WriteEntry& b) noexcept {
+  return opaque(a.addr) < opaque(b.addr);
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::end_tx(MvccTransaction& tx) noexcept {
+  auto& streak = read_only_streaks[tx.call_site];
   if (tx.is_ro) {
-    unref(tx.start_point);
+    release(tx);
+    leave(tx, true);
+    stats.count(stats.commits);
     return true;
   }
 
+  // Nothing to publish: every read was validated against start_time when it
+  // happened, so the transaction serializes there, like a read-only one.
+  // Committing it must not advance the clock and fail others' validation.
+  if (tx.write_set.empty() && tx.undo_log.empty() && tx.free_set.empty()) {
+    // Silent stores still make it a writer, like its call site
+    auto count = streak.load(std::memory_order_relaxed);
+    if (tx.call_site != 0 && !tx.silent_stores && count < READ_ONLY_STREAK) {
+      streak.store(count + 1, std::memory_order_relaxed);
+    }
+    release(tx);
+    leave(tx, true);
+    stats.count(stats.commits);
+    return true;
+  }
+  if (streak.load(std::memory_order_relaxed) != 0) {
+    streak.store(0, std::memory_order_relaxed);
+  }
+
+  // Always lock in address order: two transactions writing the same words
+  // then can't repeatedly abort each other by locking them in opposite order
+  std::sort(tx.write_set.begin(), tx.write_set.end(), by_address);
+
   // First, try acquiring all locks in the write set
   auto it = tx.write_set.begin();
   auto rollback_locks = [&it, &tx] {
@@ -113,64 +1031,701 @@ bool SharedMemory::end_tx(Transaction& tx) noexcept {
     //           << tx.alloc_set.size() << '\n';
   };
 
-  std::unordered_set<std::size_t> acquired_locks;
   // std::cout << "Acquiring write set:\n";
   while (it != tx.write_set.end()) {
-    // std::cout << it->addr.offset << '\n';
-    if (!it->obj.lock.try_lock(tx.start_time)) {
+    // std::cout << it->addr.offset() << '\n';
+    // A delta doesn't depend on the word's value, so any version will do
+    auto last_seen = it->delta ? VersionedLock::ANY_VERSION : tx.start_time;
+    auto& lock = allocator.lock_of(it->addr);
+    it->lock = &lock;
+    // Words sharing a lock are next to each other, unless an eager write
+    // took it
+    bool taken =
+        (it != tx.write_set.begin() && std::prev(it)->lock == &lock) ||
+        tx.eager_writes(lock) != 0;
+    it->owns_lock = !taken;
+    bool locked = taken ? lock.version() <= last_seen ||
+                              unchanged_locked(tx, it->addr, *it->obj)
+                        : lock.try_lock(last_seen, lock_spin(tx)) ||
+                              lock_unchanged(tx, lock, it->addr, *it->obj);
+    if (!locked) {
       rollback_locks();
+      stats.count(stats.lock_aborts);
+      if (replaced(it->addr, lock)) {
+        stats.count(stats.stale_locks);
+      }
+      contended(tx, it->addr);
       abort(tx);
       return false;
     }
-    acquired_locks.insert(opaque(it->addr));
     it++;
   }
 
+  // Words checked by value must not have changed since now either: with
+  // the others unchanged since start_time, the reads all hold at this time
+  auto validated_at = clock.load();
+
   // std::cout << "Validating read set: \n";
   // Validate read set
   for (auto& read : tx.read_set) {
-    if (acquired_locks.find(opaque(read.addr)) != acquired_locks.end()) {
+    if (allocator.lock_of(read.addr).validate(tx.start_time) ||
+        unchanged(tx, read.addr, *read.obj, validated_at) ||
+        tx.find_undo_entry(read.addr) != nullptr) {
       continue;
     }
-    if (!read.obj.lock.validate(tx.start_time)) {
-      /*
-      std::cout << "lock validation of object " << read.addr.offset
-                << " failed: start_time=" << tx.start_time
-                << " but lock_version=" << read.obj.lock.version()
-                << " and locked=" << read.obj.lock.locked() << '\n';
-      */
-      rollback_locks();
-      abort(tx);
+    /*
+    std::cout << "lock validation of object " << read.addr.offset()
+              << " failed: start_time=" << tx.start_time
+              << " but lock_version="
+              << allocator.lock_of(read.addr).version() << " and locked="
+              << allocator.lock_of(read.addr).locked() << '\n';
+    */
+    rollback_locks();
+    stats.count(stats.validation_aborts);
+    contended(tx, read.addr);
+    abort(tx);
+    return false;
+  }
+
+  if (!apply_deltas(tx)) {
+    rollback_locks();
+    stats.count(stats.escrow_aborts);
+    abort(tx);
+    return false;
+  }
+
+  elide_silent_stores(tx);
+  if (tx.write_set.empty() && tx.undo_log.empty() && tx.free_set.empty()) {
+    // Serializes at validation, like a transaction that wrote nothing
+    release(tx);
+    leave(tx, true);
+    stats.count(stats.commits);
+    return true;
+  }
+
+  // std::cout << "Committing changes\n";
+  publish_commit(tx);
+
+  release(tx);
+  leave(tx, true);
+  stats.count(stats.commits);
+  if (granularity_due.load(std::memory_order_relaxed) &&
+      granularity_due.exchange(false, std::memory_order_relaxed)) {
+    adapt_granularity();
+  }
+  return true;
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::apply_deltas(
+    MvccTransaction& tx) noexcept {
+  for (auto& write : tx.write_set) {
+    if (!write.delta) {
+      continue;
+    }
+    // Locked, so the latest version is the one the delta will follow
+    auto* latest = write.obj->latest.load(std::memory_order_acquire);
+    write.written =
+        clone(latest->buf.get() + allocator.unit_offset(write.addr), align);
+    if (!write.delta->apply(write.written.get(), align)) {
       return false;
     }
   }
+  return true;
+}
 
-  // std::cout << "Committing changes\n";
-  {
-    std::unique_lock lock(descriptor_mutex);
-    commit_changes(tx);
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::elide_silent_stores(
+    MvccTransaction& tx) {
+  // Entries sharing a lock are next to each other: the first one kept
+  // releases it, or the last one dropped if none is
+  std::size_t kept = 0;
+  VersionedLock* run = nullptr;
+  bool owed = false;
+  for (auto& write : tx.write_set) {
+    if (write.lock != run) {
+      if (owed) {
+        run->unlock();
+      }
+      run = write.lock;
+      owed = write.owns_lock;
+    }
+    auto* latest = write.obj->latest.load(std::memory_order_relaxed);
+    if (std::memcmp(latest->buf.get() + allocator.unit_offset(write.addr),
+                    write.written.get(), align) == 0) {
+      stats.count(stats.silent_stores);
+      continue;
+    }
+    write.owns_lock = std::exchange(owed, false);
+    tx.write_set[kept++] = std::move(write);
   }
+  if (owed) {
+    run->unlock();
+  }
+  tx.write_set.resize(kept);
 
+  // Eager writes are in place already: undo those that changed nothing, and
+  // hold a lock of their own
+  if (tx.undo_log.empty()) {
+    return;
+  }
+  std::unordered_set<const VersionedLock*> with_writes;
+  for (auto& write : tx.write_set) {
+    if (tx.eager_writes(*write.lock) != 0) {
+      with_writes.insert(write.lock);
+    }
+  }
+  auto shares_lock = [&](std::size_t i) {
+    auto* lock = tx.undo_log[i].lock;
+    return tx.eager_writes(*lock) > 1 || with_writes.count(lock) != 0;
+  };
+  auto is_silent = [&](std::size_t i) {
+    auto& undo = tx.undo_log[i];
+    return std::memcmp(undo.pending->buf.get(),
+                       undo.pending->earlier->buf.get(), align) == 0 &&
+           !shares_lock(i);
+  };
+  std::size_t first = 0;
+  while (first < tx.undo_log.size() && !is_silent(first)) {
+    first++;
+  }
+  if (first == tx.undo_log.size()) {
+    return;
+  }
+  std::vector<bool> silent(tx.undo_log.size());
+  std::size_t from = tx.undo_log.size() - 1;
+  silent[first] = true;
+  for (auto i = first + 1; i < tx.undo_log.size(); ++i) {
+    silent[i] = is_silent(i);
+    from -= silent[i];
+  }
+  // Those go last, to be undone alone
+  std::vector<MvccTransaction::UndoEntry> ordered;
+  ordered.reserve(tx.undo_log.size());
+  for (bool last : {false, true}) {
+    for (std::size_t i = 0; i < tx.undo_log.size(); ++i) {
+      if (silent[i] == last) {
+        ordered.push_back(tx.undo_log[i]);
+      }
+    }
+  }
+  tx.undo_log = std::move(ordered);
+  tx.reindex_undo_log();
+  for (auto i = from; i < tx.undo_log.size(); ++i) {
+    stats.count(stats.silent_stores);
+  }
+  undo_writes(tx, from);
+  tx.truncate_undo_log(from);
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::unchanged(
+    const MvccTransaction& tx, ObjectId addr, const Object& obj,
+    VersionedLock::Timestamp until) noexcept {
+  auto& lock = allocator.lock_of(addr);
+  auto seen = lock.stable_version();
+  if (seen == VersionedLock::ANY_VERSION) {
+    // Maybe taken by the transaction itself, for this word or a neighbour
+    if (holds(tx, addr, lock)) {
+      if (lock.version() <= tx.start_time) {
+        return true;
+      }
+      if (!unchanged_locked(tx, addr, obj)) {
+        return false;
+      }
+      stats.count(stats.value_validations);
+      return true;
+    }
+    // A granularity switch holds its table's locks only for a moment, and
+    // the word's lock then lies in the new table
+    if (allocator.switching(addr) || replaced(addr, lock)) {
+      while (allocator.switching(addr)) {
+        std::this_thread::yield();
+      }
+      return unchanged(tx, addr, obj, until);
+    }
+    // A shared lock is likely held for a neighbour: give its holder the
+    // time to commit, and check the word itself then
+    if (!allocator.coarse(addr)) {
+      return false;
+    }
+    for (auto spin = lock_spin(tx);
+         seen == VersionedLock::ANY_VERSION && spin > 0; --spin) {
+      cpu_relax();
+      seen = lock.stable_version();
+    }
+    if (seen == VersionedLock::ANY_VERSION) {
+      return false;
+    }
+  }
+  if (seen <= tx.start_time) {
+    return true;
+  }
+  if (seen > until) {
+    return false;
+  }
+  // A pending version may be undone meanwhile: only committed ones count
+  auto* latest = obj.latest.load(std::memory_order_acquire);
+  auto offset = allocator.unit_offset(addr);
+  if (latest->version.load(std::memory_order_acquire) ==
+          ObjectVersion::PENDING ||
+      std::memcmp(latest->buf.get() + offset,
+                  snapshot(tx, obj)->buf.get() + offset, align) != 0 ||
+      lock.stable_version() != seen) {
+    return false;
+  }
+  stats.count(stats.value_validations);
   return true;
 }
 
-void SharedMemory::abort(Transaction& tx) {
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::unchanged_locked(
+    const MvccTransaction& tx, ObjectId addr,
+    const Object& obj) const noexcept {
+  auto* latest = obj.latest.load(std::memory_order_relaxed);
+  auto offset = allocator.unit_offset(addr);
+  return std::memcmp(latest->buf.get() + offset,
+                     snapshot(tx, obj)->buf.get() + offset, align) == 0;
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::lock_unchanged(
+    const MvccTransaction& tx, VersionedLock& lock, ObjectId addr,
+    const Object& obj) noexcept {
+  // Otherwise the lock is just busy, and try_lock() already waited for it
+  if (lock.version() <= tx.start_time ||
+      !lock.try_lock(VersionedLock::ANY_VERSION, lock_spin(tx))) {
+    return false;
+  }
+  if (!unchanged_locked(tx, addr, obj)) {
+    lock.unlock();
+    return false;
+  }
+  stats.count(stats.value_validations);
+  return true;
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::holds(
+    const MvccTransaction& tx, ObjectId addr,
+    const VersionedLock& lock) const noexcept {
+  // Once locking began, the write set is sorted by address and the entries
+  // sharing a lock are next to each other
+  if (!tx.write_set.empty() && tx.write_set.front().lock != nullptr) {
+    auto found = std::lower_bound(
+        tx.write_set.begin(), tx.write_set.end(), opaque(addr),
+        [](const auto& entry, std::size_t key) {
+          return opaque(entry.addr) < key;
+        });
+    if ((found != tx.write_set.end() && found->lock == &lock) ||
+        (found != tx.write_set.begin() && std::prev(found)->lock == &lock)) {
+      return true;
+    }
+  }
+  return tx.eager_writes(lock) != 0;
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::adapt_granularity() {
+  const auto slot = ThreadSlot::index();
+  if (slot == ThreadSlot::NONE) {
+    return;
+  }
+  std::vector<std::unique_ptr<VersionedLock[]>> replaced_tables;
+  allocator.visit_next_segment([&](SharedSegment& segment) {
+    // Tables with a busy lock, or past the switches one check may make, are
+    // left for the next one
+    const auto tables = segment.table_count();
+    for (std::size_t seen = 0; seen < tables; ++seen) {
+      auto t = (segment.next_table + seen) % tables;
+      if (replaced_tables.size() == SWITCHES_PER_CHECK) {
+        segment.next_table = t;
+        break;
+      }
+      auto& check = segment.checks[t];
+      auto shift = segment.shift_of(t);
+      auto target = shift;
+      if (check.conflicts.exchange(0, std::memory_order_relaxed) != 0) {
+        check.quiet_periods = 0;
+        target = 0;
+      } else if (shift == 0 &&
+                 ++check.quiet_periods >=
+                     COARSEN_AFTER << std::min(check.splits, 8u)) {
+        target = SharedSegment::COARSE_SHIFT;
+      }
+      if (target == shift) {
+        continue;
+      }
+      if (auto old = segment.regranulate(t, target)) {
+        replaced_tables.push_back(std::move(old));
+        check.splits += target == 0;
+        stats.count(stats.regranulations);
+      } else if (target == 0) {
+        check.conflicts.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  });
+  if (replaced_tables.empty()) {
+    return;
+  }
+
+  // Whoever starts from the next commit time or later looks up the new
+  // tables: its holder took it after this, and the clock only gets there
+  // once it's installed
+  const auto time = issued.fetch_add(0) + 1;
+  auto& state = threads[slot];
+  for (auto& table : replaced_tables) {
+    retire(state, time, std::move(table));
+  }
+  reclaim(state);
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::publish_commit(MvccTransaction& tx) {
+  auto& slot = commit_slots[ThreadSlot::index() % COMMIT_SLOTS];
+  MvccTransaction* expected = nullptr;
+  while (!slot.pending.compare_exchange_weak(expected, &tx,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed)) {
+    // Another thread maps to the same slot: get its commit installed first
+    expected = nullptr;
+    std::unique_lock lock(descriptor_mutex);
+    combine_commits();
+  }
+
+  // Whoever holds descriptor_mutex installs every published transaction, so
+  // most of the time we only have to wait for the current combiner to finish
+  unsigned spin = 0;
+  while (slot.pending.load(std::memory_order_acquire) == &tx) {
+    if (descriptor_mutex.try_lock()) {
+      combine_commits();
+      descriptor_mutex.unlock();
+    } else if (spin < config.lock_spin) {
+      spin++;
+      cpu_relax();
+    } else {
+      std::unique_lock lock(descriptor_mutex);
+      combine_commits();
+    }
+  }
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::abort(MvccTransaction& tx) {
+  stats.count(stats.aborts);
+  tx.aborted = true;
+  if (!tx.undo_log.empty()) {
+    undo_writes(tx, 0);
+  }
   for (auto segment : tx.alloc_set) {
     allocator.free(segment);
   }
   for (auto segment : tx.free_set) {
     allocator.find_segment(segment).cancel_deletion();
   }
-  unref(tx.start_point);
+  release(tx);
+  leave(tx, false);
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::leave(MvccTransaction& tx,
+                                            bool committed) noexcept {
+  if constexpr (Versioning::adaptive) {
+    if (tx.gated) {
+      tx.gated = false;
+      mode_switch.leave(tx.mode, committed, tx.read_set.size(),
+                        tx.write_set.size() + tx.undo_log.size());
+    }
+  }
+  if (tx.scheduled) {
+    tx.scheduled = false;
+    scheduler.leave(ThreadSlot::index(), tx.queues, committed, tx.conflict_on);
+  }
+  if (tx.favoured) {
+    tx.favoured = false;
+    priorities.leave_high();
+  }
+  if (tx.eager_slot != ThreadSlot::NONE) {
+    auto& eager = threads[tx.eager_slot].eager;
+    eager.erase(std::find(eager.begin(), eager.end(), &tx));
+    tx.eager_slot = ThreadSlot::NONE;
+  }
+  if (tx.suspendable && ThreadSlot::index() != ThreadSlot::NONE) {
+    threads[ThreadSlot::index()].conflict =
+        committed ? std::nullopt : tx.conflict_on;
+  }
+  if (tx.timed) {
+    tx.timed = false;
+    priorities.ended(ThreadSlot::index(), tx.call_site, tx.priority,
+                     tx.started, committed, stats.active());
+  }
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::undo_writes(MvccTransaction& tx,
+                                                  std::size_t from) {
+  for (auto i = from; i < tx.undo_log.size(); ++i) {
+    auto& undo = tx.undo_log[i];
+    undo.obj->latest.store(undo.pending->earlier, std::memory_order_release);
+  }
+  // Once all words under a shared lock are restored
+  for (auto i = from; i < tx.undo_log.size(); ++i) {
+    if (tx.undo_log[i].owns_lock) {
+      tx.undo_log[i].lock->unlock();
+    }
+  }
+
+  // Concurrent readers may still be looking at the pending versions, so they
+  // are reclaimed like any other replaced version
+  std::unique_lock lock(descriptor_mutex);
+  auto cur_point = current.load(std::memory_order_acquire);
+  for (auto i = from; i < tx.undo_log.size(); ++i) {
+    cur_point->objects_to_delete.emplace_back(tx.undo_log[i].pending);
+  }
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::begin_nested(
+    MvccTransaction& tx) noexcept {
+  tx.savepoints.push_back({tx.next_savepoint++, tx.write_set.size(),
+                           tx.read_set.size(), tx.undo_log.size(),
+                           tx.alloc_set.size(), tx.free_set.size(),
+                           tx.saved_entries.size(), tx.saved_words.size()});
+}
+
+template <typename Versioning, typename Clock>
+Scope SharedMemory<Versioning, Clock>::end_nested(
+    MvccTransaction& tx) noexcept {
+  if (tx.aborted) {
+    return Scope::aborted;
+  }
+  tx.savepoints.pop_back();
+  if (tx.scope_failed) {
+    tx.scope_failed = false;
+    return Scope::retry;
+  }
+  // What the scope saved now belongs to the enclosing one, if any
+  if (tx.savepoints.empty()) {
+    tx.saved_entries.clear();
+    tx.saved_words.clear();
+  }
+  return Scope::committed;
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::conflict(MvccTransaction& tx) {
+  // Under snapshot isolation, only a write to a word committed since the
+  // snapshot conflicts, and moving the snapshot would break its isolation
+  if (!tx.savepoints.empty() && !tx.snapshot_isolation && rollback_scope(tx)) {
+    stats.count(stats.scope_rollbacks);
+    tx.scope_failed = true;
+    // Whoever we conflicted with is likely still committing: give it the
+    // chance to finish before the scope runs again
+    std::this_thread::yield();
+    return;
+  }
+  abort(tx);
+}
+
+template <typename Versioning, typename Clock>
+bool SharedMemory<Versioning, Clock>::rollback_scope(MvccTransaction& tx) {
+  auto& scope = tx.savepoints.back();
+
+  // Newest first, so that each word ends up with its oldest saved value.
+  // Words first: they may live in segments or versions released below.
+  for (auto i = tx.saved_words.size(); i-- > scope.saved_words;) {
+    auto& saved = tx.saved_words[i];
+    std::memcpy(saved.word, saved.bytes.get(), align);
+  }
+  tx.saved_words.resize(scope.saved_words);
+
+  if (tx.undo_log.size() > scope.undo_log) {
+    undo_writes(tx, scope.undo_log);
+    tx.truncate_undo_log(scope.undo_log);
+  }
+
+  // Entries dropped in the scope may have left holes, all of them saved
+  tx.write_set.resize(scope.write_set);
+  for (auto i = tx.saved_entries.size(); i-- > scope.saved_entries;) {
+    auto& saved = tx.saved_entries[i];
+    // Saved by an inner scope, for an entry this one created
+    if (saved.index < scope.write_set) {
+      tx.write_set[saved.index] = std::move(saved.entry);
+    }
+  }
+  tx.saved_entries.resize(scope.saved_entries);
+
+  tx.read_set.resize(scope.read_set);
+  // Before releasing segments, which may be among the freed ones
+  for (auto i = scope.free_set; i < tx.free_set.size(); ++i) {
+    allocator.find_segment(tx.free_set[i]).cancel_deletion();
+  }
+  tx.free_set.resize(scope.free_set);
+  for (auto i = scope.alloc_set; i < tx.alloc_set.size(); ++i) {
+    allocator.free(tx.alloc_set[i]);
+  }
+  tx.alloc_set.resize(scope.alloc_set);
+
+  // Retrying from the same snapshot would hit the same conflict: move the
+  // rest of the transaction to the current clock, if nothing it read has
+  // changed since it started
+  auto now = clock.load();
+  for (auto& read : tx.read_set) {
+    if (!unchanged(tx, read.addr, *read.obj, now) &&
+        tx.find_undo_entry(read.addr) == nullptr) {
+      return false;
+    }
+  }
+  tx.start_time = now;
+  return true;
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::save_entry(
+    MvccTransaction& tx, MvccTransaction::WriteEntry& entry) {
+  if (tx.savepoints.empty()) {
+    return;
+  }
+  auto& scope = tx.savepoints.back();
+  auto index = static_cast<std::size_t>(&entry - tx.write_set.data());
+  // Created by the scope, or already saved by it
+  if (index >= scope.write_set || entry.saved_in == scope.id) {
+    return;
+  }
+  std::unique_ptr<char[]> written;
+  if (entry.written) {
+    written = clone(entry.written.get(), align);
+  }
+  tx.saved_entries.push_back({index,
+                              {entry.addr, entry.obj, std::move(written),
+                               entry.delta, entry.saved_in}});
+  entry.saved_in = scope.id;
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::save_word(MvccTransaction& tx,
+                                                char* word) {
+  if (!tx.savepoints.empty()) {
+    tx.saved_words.push_back({word, clone(word, align)});
+  }
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::drop_write_entry(
+    MvccTransaction& tx, MvccTransaction::WriteEntry& entry) {
+  // The last entry takes the dropped one's place
+  save_entry(tx, entry);
+  save_entry(tx, tx.write_set.back());
+  tx.drop_write_entry(entry);
 }
 
-void SharedMemory::commit_changes(Transaction& tx) {
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::combine_commits() {
+  const auto used_slots = std::min(ThreadSlot::high_water(), COMMIT_SLOTS);
+
+  TransactionDescriptor* descr = nullptr;
+  for (std::size_t i = 0; i < used_slots; ++i) {
+    auto& slot = commit_slots[i];
+    auto* tx = slot.pending.load(std::memory_order_acquire);
+    if (tx == nullptr) {
+      continue;
+    }
+    // All transactions in the batch hold the locks on their write sets, so
+    // they are disjoint and can share a single commit time
+    if (descr == nullptr) {
+      descr = next_descriptor(next_commit_time());
+    }
+    commit_changes(*tx, *descr);
+    slot.pending.store(nullptr, std::memory_order_release);
+  }
+  if (descr == nullptr) {
+    return;
+  }
+  stats.count(stats.commit_batches);
+  advance_clock(descr->commit_time);
+  if (descr->commit_time % RECLAIM_PERIOD == 0) {
+    collect();
+  }
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::advance_clock(
+    VersionedLock::Timestamp commit_time) {
+  // Whoever finds the next commit time installed moves the clock over it: a
+  // holder of an earlier one that was preempted while installing holds back
+  // the clock, but not the commits after its own. Transactions starting from
+  // the clock must see the whole commit. Only an announcement re-checking
+  // the clock needs it ordered before advance_pin() reads the announcements;
+  // otherwise release will do.
+  installed[commit_time % INSTALL_RING].store(commit_time,
+                                              std::memory_order_release);
+  auto now = clock.load(std::memory_order_acquire);
+  while (installed[(now + 1) % INSTALL_RING].load(std::memory_order_acquire) ==
+         now + 1) {
+    if (clock.compare_exchange_weak(now, now + 1,
+                                    Clock::per_thread
+                                        ? std::memory_order_seq_cst
+                                        : std::memory_order_acq_rel,
+                                    std::memory_order_acquire)) {
+      if (++now % GRANULARITY_PERIOD == 0) {
+        granularity_due.store(true, std::memory_order_relaxed);
+      }
+    }
+  }
+  // The next snapshots of whoever committed must hold the commit
+  await_clock(commit_time);
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::collect() {
+  const auto now = clock.load();
+  if (now > current.load(std::memory_order_relaxed)->commit_time) {
+    next_descriptor(now);
+  }
+  if constexpr (Clock::per_thread) {
+    advance_pin();
+  }
+
+  // A call announced after this scan re-reads the clock after `now`
+  auto until = std::min(now, horizon.load(std::memory_order_acquire));
+  const auto threads_seen = ThreadSlot::high_water();
+  for (std::size_t i = 0; i < threads_seen; ++i) {
+    until = std::min(until, threads[i].operating.load());
+  }
+  if (until > reclaimable.load(std::memory_order_relaxed)) {
+    reclaimable.store(until, std::memory_order_release);
+  }
+}
+
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::advance_pin() {
+  // Nobody started before the earliest announced clock, so descriptors older
+  // than that one hold nothing that can still be read
+  auto earliest = clock.load();
+  const auto threads = ThreadSlot::high_water();
+  for (std::size_t i = 0; i < threads; ++i) {
+    earliest = std::min(earliest, thread_clocks[i].announced.load());
+  }
+
+  auto* target = oldest;
+  while (target->next != nullptr && target->next->commit_time <= earliest) {
+    target = target->next;
+  }
+  if (target != oldest) {
+    ref(target);
+    unref(oldest);
+    oldest = target;
+  }
+}
+
+template <typename Versioning, typename Clock>
+TransactionDescriptor* SharedMemory<Versioning, Clock>::next_descriptor(
+    VersionedLock::Timestamp commit_time) {
   auto cur_point = current.load(std::memory_order_acquire);
 
   // std::cout << "On commit, cur_point has refcount="
   //          << cur_point->refcount.load() << '\n';
 
-  auto commit_time = cur_point->commit_time + 1;
   auto* descr = new TransactionDescriptor{commit_time};
 
   cur_point->next = descr;
@@ -181,53 +1736,109 @@ void SharedMemory::commit_changes(Transaction& tx) {
 
   // refcount is already 1 since current now holds that
   current.store(descr, std::memory_order_release);
+  return descr;
+}
 
-  descr->segments_to_delete = std::move(tx.free_set);
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::commit_changes(
+    MvccTransaction& tx, TransactionDescriptor& descr) {
+  const auto commit_time = descr.commit_time;
 
-  for (auto& write : tx.write_set) {
-    auto& obj = write.obj;
+  descr.segments_to_delete.insert(descr.segments_to_delete.end(),
+                                  tx.free_set.begin(), tx.free_set.end());
+
+  for (auto it = tx.write_set.begin(); it != tx.write_set.end();) {
+    auto& obj = *it->obj;
 
     auto* old_version = obj.latest.load(std::memory_order_acquire);
 
-    auto* new_version = new ObjectVersion(std::move(write.written));
+    // A page is copied once for all the words written to it, which are next
+    // to each other in the sorted write set
+    std::unique_ptr<char[]> buf;
+    if (!allocator.paged(it->addr)) {
+      buf = std::move(it->written);
+      ++it;
+    } else {
+      buf = clone(old_version->buf.get(), SharedSegment::PAGE_SIZE);
+      for (; it != tx.write_set.end() && it->obj == &obj; ++it) {
+        std::memcpy(buf.get() + allocator.unit_offset(it->addr),
+                    it->written.get(), align);
+      }
+      stats.count(stats.page_copies);
+    }
+    auto* new_version = new ObjectVersion(std::move(buf));
 
     new_version->version = commit_time;
     new_version->earlier = old_version;
 
     obj.latest.store(new_version, std::memory_order_release);
-    descr->objects_to_delete.emplace_back(old_version);
+    descr.objects_to_delete.emplace_back(old_version);
+  }
 
-    // std::cout << "unlocking object " << write.addr.offset
-    //          << " with timestamp=" << commit_time << '\n';
-    obj.lock.unlock(commit_time);
+  for (auto& undo : tx.undo_log) {
+    undo.pending->version.store(commit_time, std::memory_order_release);
+    descr.objects_to_delete.emplace_back(undo.pending->earlier);
   }
 
-  unref(tx.start_point);
+  // Once all words under a shared lock are installed
+  for (auto& write : tx.write_set) {
+    // std::cout << "unlocking object " << write.addr.offset()
+    //          << " with timestamp=" << commit_time << '\n';
+    if (write.owns_lock) {
+      write.lock->unlock(commit_time);
+    }
+  }
+  for (auto& undo : tx.undo_log) {
+    if (undo.owns_lock) {
+      undo.lock->unlock(commit_time);
+    }
+  }
 }
 
-void SharedMemory::ref(TransactionDescriptor* desc) {
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::ref(TransactionDescriptor* desc) {
   if (desc == nullptr) {
     return;
   }
   desc->refcount.fetch_add(1, std::memory_order_acq_rel);
 }
 
-void SharedMemory::unref(TransactionDescriptor* desc) {
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::unref(TransactionDescriptor* desc) {
   if (desc == nullptr) {
     return;
   }
 
   auto previous = desc->refcount.fetch_sub(1, std::memory_order_acq_rel);
   if (previous == 1) {
+    // Nobody starts before the next one: descriptors are freed in order,
+    // though not always by the same thread
+    if (desc->next != nullptr) {
+      auto seen = horizon.load(std::memory_order_relaxed);
+      while (seen < desc->next->commit_time &&
+             !horizon.compare_exchange_weak(seen, desc->next->commit_time,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+      }
+    }
     unref(desc->next);
     commit_frees(*desc);
     delete desc;
   }
 }
 
-void SharedMemory::commit_frees(TransactionDescriptor& desc) {
+template <typename Versioning, typename Clock>
+void SharedMemory<Versioning, Clock>::commit_frees(
+    TransactionDescriptor& desc) {
   for (auto segm : desc.segments_to_delete) {
-    // std::cout << "Actually freeing segment " << +segm.segment << '\n';
+    // std::cout << "Actually freeing segment " << +segm.segment() << '\n';
     allocator.free(segm);
   }
 }
+
+template class SharedMemory<LazyVersioning, GlobalClock>;
+template class SharedMemory<LazyVersioning, PerThreadClock>;
+template class SharedMemory<EagerVersioning, GlobalClock>;
+template class SharedMemory<EagerVersioning, PerThreadClock>;
+template class SharedMemory<AdaptiveVersioning, GlobalClock>;
+template class SharedMemory<AdaptiveVersioning, PerThreadClock>;
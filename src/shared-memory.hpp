@@ -1,18 +1,27 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <mutex>
+#include <optional>
 #include <utility>
 #include <vector>
 
+#include "config.hpp"
+#include "conflict-scheduler.hpp"
+#include "policies.hpp"
+#include "priority.hpp"
 #include "segment-allocator.hpp"
 #include "shared-segment.hpp"
+#include "stats.hpp"
+#include "thread-slot.hpp"
+#include "tm-ext.hpp"
 #include "transaction.hpp"
 
-class SharedMemory {
+template <typename Versioning, typename Clock> class SharedMemory {
 public:
-  SharedMemory(std::size_t size, std::size_t align) noexcept
-      : align(align), allocator(size, align) {}
+  SharedMemory(std::size_t size, std::size_t align,
+               Config config = Config{}) noexcept;
 
   ~SharedMemory() noexcept;
 
@@ -22,14 +31,92 @@ public:
   SharedMemory(const SharedMemory&) = delete;
   SharedMemory& operator=(const SharedMemory&) = delete;
 
-  [[nodiscard]] Transaction begin_tx(bool is_ro) noexcept;
-  bool end_tx(Transaction& tx) noexcept;
+  using Tx = MvccTransaction;
+  using Snapshot = SharedSnapshot;
 
-  bool read_word(Transaction& tx, ObjectId src, char* dest) noexcept;
-  bool write_word(Transaction& tx, const char* src, ObjectId dest) noexcept;
+  [[nodiscard]] MvccTransaction
+  begin_tx(bool is_ro, const void* call_site = nullptr,
+           Priority priority = Priority::normal, std::uint64_t budget = 0,
+           bool suspendable = false) noexcept;
+  // A transaction whose thread runs others while it's suspended, see
+  // MvccTransaction::suspendable
+  [[nodiscard]] MvccTransaction
+  begin_suspendable(bool is_ro, const void* call_site = nullptr) noexcept {
+    return begin_tx(is_ro, call_site, Priority::normal, 0, true);
+  }
+  // Word the calling thread's latest suspendable transaction aborted on, if
+  // it did on a busy lock or a newer version
+  [[nodiscard]] const void* conflict() const noexcept;
+  [[nodiscard]] bool locked(const void* word) noexcept {
+    return allocator.locked(allocator.to_object_id(word));
+  }
+  // A read-write transaction under snapshot isolation, which allows write
+  // skew in exchange for never aborting on what it read
+  [[nodiscard]] MvccTransaction
+  begin_si(const void* call_site = nullptr) noexcept;
+  bool end_tx(MvccTransaction& tx) noexcept;
+  // Shares a read-only transaction's snapshot, until released: read-only
+  // transactions on other threads may start from it. Null for read-write
+  // transactions.
+  [[nodiscard]] SharedSnapshot*
+  export_snapshot(const MvccTransaction& tx) noexcept;
+  [[nodiscard]] MvccTransaction
+  begin_at(const SharedSnapshot& snapshot) noexcept;
+  void release_snapshot(SharedSnapshot* snapshot) noexcept;
+  // Rolls back a transaction the caller gives up on
+  void cancel(MvccTransaction& tx) noexcept { abort(tx); }
+
+  // Copy `size` bytes, a multiple of the alignment, word by word
+  bool read(MvccTransaction& tx, const void* source, std::size_t size,
+            void* target) noexcept;
+  bool write(MvccTransaction& tx, const void* source, std::size_t size,
+             void* target) noexcept;
+
+  // Points at `size` bytes of the transaction's snapshot, valid until it
+  // ends. Null if the transaction was aborted. In place for a read-only
+  // transaction within one version, a word or a page of a paged segment;
+  // otherwise a copy, like read().
+  const void* read_view(MvccTransaction& tx, const void* source,
+                        std::size_t size) noexcept;
+
+  // Several ranges in one pass: each range's first word's metadata is
+  // prefetched, so that the cache misses overlap, then all ranges are accessed
+  bool read_many(MvccTransaction& tx, const Access* accesses,
+                 std::size_t count) noexcept;
+  bool write_many(MvccTransaction& tx, const Access* accesses,
+                  std::size_t count) noexcept;
+
+  // Adds a delta to the integer word at `target` when the transaction
+  // commits, without reading it, see delta.hpp
+  bool add(MvccTransaction& tx, void* target, const Delta& delta) noexcept;
 
-  bool allocate(Transaction& tx, std::size_t size, ObjectId* addr) noexcept;
-  void free(Transaction& tx, ObjectId addr) noexcept;
+  bool allocate(MvccTransaction& tx, std::size_t size, void** target) noexcept;
+  void free(MvccTransaction& tx, void* target) noexcept;
+
+  // Single words outside of any transaction, linearizable with transactions.
+  // A load reads the latest snapshot like a read-only transaction; a store
+  // or compare-and-swap locks the word and commits it on its own. Both give
+  // up, writing nothing, on a lock held by the calling thread's own open
+  // transaction: a store then returns false, a compare-and-swap false with
+  // `expected` left as it was.
+  void atomic_load(const void* source, void* target) noexcept;
+  bool atomic_store(const void* source, void* target) noexcept;
+  // Stores `desired` if the word equals `expected`, otherwise copies the word
+  // into `expected`
+  bool atomic_cas(void* target, void* expected, const void* desired) noexcept;
+
+  // Closed nesting: a conflict inside a scope only rolls back that scope, as
+  // long as the rest of the transaction can move on to a newer snapshot
+  void begin_nested(MvccTransaction& tx) noexcept;
+  Scope end_nested(MvccTransaction& tx) noexcept;
+  // Whether a failed operation leaves the transaction to its scope's end
+  [[nodiscard]] bool nested(const MvccTransaction& tx) const noexcept {
+    return !tx.savepoints.empty();
+  }
+
+  // Checks that the transaction may modify shared memory. A transaction
+  // wrongly inferred as read-only is aborted, to be retried as read-write.
+  bool writable(MvccTransaction& tx) noexcept;
 
   [[nodiscard]] std::size_t size() const noexcept {
     return allocator.first_segment().size_bytes();
@@ -37,24 +124,276 @@ public:
 
   [[nodiscard]] std::size_t alignment() const noexcept { return align; };
 
-  [[nodiscard]] ObjectId start_addr() const noexcept {
-    return allocator.first_addr();
+  // How read-write transactions currently run
+  [[nodiscard]] Mode mode() const noexcept {
+    if constexpr (Versioning::adaptive) {
+      return mode_switch.current();
+    }
+    return Versioning::eager ? Mode::eager : Mode::lazy;
   }
 
+  [[nodiscard]] void* start_addr() const noexcept {
+    return allocator.to_address(allocator.first_addr());
+  }
+
+  // Number of slots in which committers publish their validated transactions
+  static constexpr std::size_t COMMIT_SLOTS = 64;
+
+  // Read-write transactions that committed without writing, in a row, after
+  // which a named call site's transactions are started as read-only
+  static constexpr std::uint8_t READ_ONLY_STREAK = 8;
+  static constexpr std::size_t CALL_SITES = 256;
+
+  // How many clock ticks pass between reclamation passes, see collect()
+  static constexpr VersionedLock::Timestamp RECLAIM_PERIOD = 16;
+
+  // How many commits pass between checks of a segment's conflicts, one
+  // segment after the other. A lock table shares its locks between
+  // neighbouring words once it's seen no conflict for COARSEN_AFTER checks
+  // in a row, twice as many after each split, and splits them again on a
+  // conflict. Each check switches up to SWITCHES_PER_CHECK tables, one at
+  // a time.
+  static constexpr VersionedLock::Timestamp GRANULARITY_PERIOD = 256;
+  static constexpr unsigned COARSEN_AFTER = 16;
+  static constexpr std::size_t SWITCHES_PER_CHECK = 16;
+
 private:
   void ref(TransactionDescriptor* desc);
   void unref(TransactionDescriptor* desc);
 
   void commit_frees(TransactionDescriptor& desc);
 
-  void abort(Transaction& tx);
-  void commit_changes(Transaction& tx);
+  struct ThreadState;
+  // Under descriptor_mutex, every RECLAIM_PERIOD ticks: starts a descriptor
+  // if single-word commits moved the clock past the current one, and works
+  // out up to which time the retire lists may be freed
+  void collect();
+  // What a single-word commit or a granularity switch replaced at `time`,
+  // freed by its thread once nobody can still read it
+  void retire(ThreadState& state, VersionedLock::Timestamp time,
+              ObjectVersion* version);
+  void retire(ThreadState& state, VersionedLock::Timestamp time,
+              std::unique_ptr<VersionedLock[]> table);
+  void reclaim(ThreadState& state) noexcept;
+
+  // Takes the start time and keeps its snapshot from being reclaimed, until
+  // release()
+  void pin(MvccTransaction& tx) noexcept;
+  bool announce(MvccTransaction& tx) noexcept;
+  void release(MvccTransaction& tx) noexcept;
+  void advance_pin();
+
+  void abort(MvccTransaction& tx);
+  // Rolls back the innermost scope if possible, otherwise aborts
+  void conflict(MvccTransaction& tx);
+  bool rollback_scope(MvccTransaction& tx);
+  // Save a write entry or a word before a scope changes it in place
+  void save_entry(MvccTransaction& tx, MvccTransaction::WriteEntry& entry);
+  void save_word(MvccTransaction& tx, char* word);
+  void drop_write_entry(MvccTransaction& tx,
+                        MvccTransaction::WriteEntry& entry);
+  // Lets the mode switch, the scheduler and the priority classes know how a
+  // transaction ended
+  void leave(MvccTransaction& tx, bool committed) noexcept;
+
+  [[nodiscard]] bool eager(const MvccTransaction& tx) const noexcept {
+    if constexpr (Versioning::adaptive) {
+      return tx.mode == Mode::eager;
+    }
+    return Versioning::eager;
+  }
+
+  // Commit combining: validated transactions are published in a slot, and
+  // whoever holds descriptor_mutex installs all of them as one batch.
+  void publish_commit(MvccTransaction& tx);
+  void combine_commits();
+  TransactionDescriptor* next_descriptor(VersionedLock::Timestamp commit_time);
+  void commit_changes(MvccTransaction& tx, TransactionDescriptor& descr);
+  // Commit times are handed out in order, without descriptor_mutex. The
+  // clock only moves to one once all earlier ones are installed.
+  [[nodiscard]] VersionedLock::Timestamp next_commit_time() noexcept {
+    return issued.fetch_add(1) + 1;
+  }
+  // Once everything committed at commit_time is in, and returns once the
+  // clock got there
+  void advance_clock(VersionedLock::Timestamp commit_time);
+
+  // Undoes the eager writes from the `from`th on
+  void undo_writes(MvccTransaction& tx, std::size_t from);
+
+  // A tm_atomic_* call keeps the lock tables it looks at from being
+  // reclaimed: announced in its thread's state, or for threads without a
+  // slot through a pinned descriptor
+  ThreadState* enter_atomic(TransactionDescriptor*& pinned) noexcept;
+  void leave_atomic(ThreadState* state, TransactionDescriptor* pinned) noexcept;
+  // Waits for a word's lock rather than giving up on it, unless one of the
+  // thread's own transactions holds it: null then
+  VersionedLock* lock_word(ObjectId addr, const ThreadState* state) noexcept;
+  // Commits a new value of a word locked by lock_word() at the next clock
+  // tick, and unlocks it
+  void commit_word(ObjectId addr, Object& obj, VersionedLock& lock,
+                   const char* src, ThreadState* state);
+  // Waits until transactions starting from the clock see `version`
+  void await_clock(VersionedLock::Timestamp version) const noexcept;
+
+  // Word accesses are specialized on the alignment, so that copies and
+  // address math use constants. Align is 0 for alignments without their own
+  // instantiation, which fall back to the runtime value.
+  template <std::size_t Align> std::size_t word_size() const noexcept {
+    if constexpr (Align == 0) {
+      return align;
+    } else {
+      return Align;
+    }
+  }
+
+  template <std::size_t Align>
+  bool read_words(MvccTransaction& tx, ObjectId start, std::size_t size,
+                  char* dest) noexcept;
+  template <std::size_t Align>
+  bool write_words(MvccTransaction& tx, const char* src, std::size_t size,
+                   ObjectId start) noexcept;
+  // Snapshot of a range of a paged segment, for read-only transactions
+  void read_pages(const MvccTransaction& tx, ObjectId start, std::size_t size,
+                  char* dest) const noexcept;
 
-  void read_word_readonly(const Transaction& tx, const Object& obj,
-                          char* dest) const noexcept;
+  template <std::size_t Align>
+  void prefetch(const Access* accesses, std::size_t count) noexcept;
+  template <std::size_t Align>
+  bool read_many_words(MvccTransaction& tx, const Access* accesses,
+                       std::size_t count) noexcept;
+  template <std::size_t Align>
+  bool write_many_words(MvccTransaction& tx, const Access* accesses,
+                        std::size_t count) noexcept;
+
+  template <std::size_t Align>
+  bool read_word(MvccTransaction& tx, ObjectId src, char* dest) noexcept;
+  template <std::size_t Align>
+  bool write_word(MvccTransaction& tx, const char* src, ObjectId dest) noexcept;
+  // Reading a word with a pending delta turns the delta into a plain write
+  template <std::size_t Align>
+  bool read_delta(MvccTransaction& tx, MvccTransaction::WriteEntry& entry,
+                  char* dest) noexcept;
+  // Adds all pending deltas to the words' latest values, once locked
+  bool apply_deltas(MvccTransaction& tx) noexcept;
+  // Drops the locked writes of the value their word already holds, which
+  // would only fail the validation of whoever read it
+  void elide_silent_stores(MvccTransaction& tx);
+
+  // Latest version committed no later than the transaction's start
+  const ObjectVersion* snapshot(const MvccTransaction& tx,
+                                const Object& obj) const noexcept;
+
+  // Whether a word still holds the value of the transaction's snapshot:
+  // either its lock wasn't released since the transaction's start, or the
+  // word was last committed no later than `until` with the same value. Words
+  // that went through A-B-A or silent writes, or only share their lock with
+  // written ones, then don't conflict.
+  bool unchanged(const MvccTransaction& tx, ObjectId addr, const Object& obj,
+                 VersionedLock::Timestamp until) noexcept;
+  // Same for a word the transaction holds the lock of
+  bool unchanged_locked(const MvccTransaction& tx, ObjectId addr,
+                        const Object& obj) const noexcept;
+  // Locks a word rewritten since the transaction's start if it's unchanged;
+  // for a lock try_lock() failed to take
+  bool lock_unchanged(const MvccTransaction& tx, VersionedLock& lock,
+                      ObjectId addr, const Object& obj) noexcept;
+  // Whether the transaction holds a word's lock, maybe through a neighbour.
+  // Write entries only hold theirs while committing.
+  [[nodiscard]] bool holds(const MvccTransaction& tx, ObjectId addr,
+                           const VersionedLock& lock) const noexcept;
+  // Rounds to wait for a busy lock: favoured transactions wait longer rather
+  // than abort, low-priority ones give up at once
+  [[nodiscard]] unsigned lock_spin(const MvccTransaction& tx) const noexcept {
+    if (tx.favoured) {
+      return config.lock_spin * PriorityClasses::FAVOURED_SPIN;
+    }
+    return tx.priority == Priority::low || tx.suspendable ? 0
+                                                          : config.lock_spin;
+  }
+  // Conflict monitoring, for the granularity of each segment's locks and
+  // for scheduling the transaction's thread
+  void contended(MvccTransaction& tx, ObjectId addr) noexcept {
+    allocator.conflict(addr);
+    tx.conflict_on = addr;
+  }
+  void adapt_granularity();
+  // Whether a granularity switch replaced a word's lock since it was looked
+  // up, which then can only fail
+  [[nodiscard]] bool replaced(ObjectId addr,
+                              const VersionedLock& lock) noexcept {
+    return &allocator.lock_of(addr) != &lock;
+  }
+  template <std::size_t Align>
+  void read_word_readonly(const MvccTransaction& tx, const Object& obj,
+                          std::size_t offset, char* dest) const noexcept;
+  template <std::size_t Align>
+  bool read_word_eager(MvccTransaction& tx, ObjectId src, Object& obj,
+                       char* dest) noexcept;
+  template <std::size_t Align>
+  bool write_word_eager(MvccTransaction& tx, const char* src,
+                        ObjectId dest) noexcept;
 
   std::size_t align;
+  Config config;
+  Stats stats;
   SegmentAllocator allocator;
   std::atomic<TransactionDescriptor*> current{new TransactionDescriptor{0}};
   std::mutex descriptor_mutex;
+
+  struct alignas(64) CommitSlot {
+    std::atomic<MvccTransaction*> pending{nullptr};
+  };
+  std::array<CommitSlot, COMMIT_SLOTS> commit_slots;
+
+  std::array<std::atomic<std::uint8_t>, CALL_SITES> read_only_streaks{};
+
+  // Commit time of the latest fully installed batch or single-word commit,
+  // and the latest one handed out
+  std::atomic<VersionedLock::Timestamp> clock{0};
+  std::atomic<VersionedLock::Timestamp> issued{0};
+  // Commit times once installed, by their remainder. Each thread holds one
+  // commit time at most, and the combiner another.
+  static constexpr std::size_t INSTALL_RING = 2 * ThreadSlot::MAX_THREADS;
+  std::unique_ptr<std::atomic<VersionedLock::Timestamp>[]> installed{
+      new std::atomic<VersionedLock::Timestamp>[INSTALL_RING] {}};
+  // Every reader starts at `horizon` or later: the commit time of the
+  // descriptor after the latest one freed. Retire lists are freed up to
+  // `reclaimable`, which tm_atomic_* calls in progress also hold back.
+  std::atomic<VersionedLock::Timestamp> horizon{0};
+  std::atomic<VersionedLock::Timestamp> reclaimable{0};
+  // Set every GRANULARITY_PERIOD clock ticks
+  std::atomic_bool granularity_due{false};
+
+  struct alignas(64) ThreadClock {
+    static constexpr auto IDLE =
+        std::numeric_limits<VersionedLock::Timestamp>::max();
+    std::atomic<VersionedLock::Timestamp> announced{IDLE};
+  };
+  std::unique_ptr<ThreadClock[]> thread_clocks;
+  // Descriptor pinned on behalf of every announced clock
+  TransactionDescriptor* oldest = nullptr;
+
+  struct alignas(64) ThreadState {
+    // Clock when the thread's tm_atomic_* call in progress started
+    std::atomic<VersionedLock::Timestamp> operating{ThreadClock::IDLE};
+    // Versions replaced by its single-word commits and lock tables replaced
+    // by its granularity switches, oldest first
+    std::vector<std::pair<VersionedLock::Timestamp,
+                          std::unique_ptr<ObjectVersion>>>
+        retired;
+    std::vector<std::pair<VersionedLock::Timestamp,
+                          std::unique_ptr<VersionedLock[]>>>
+        retired_tables;
+    // Its open transactions that hold locks for eager writes
+    std::vector<const MvccTransaction*> eager;
+    // Word its latest suspendable transaction aborted on
+    std::optional<ObjectId> conflict;
+  };
+  std::unique_ptr<ThreadState[]> threads;
+
+  // Only used under adaptive versioning
+  ModeSwitch mode_switch;
+  ConflictScheduler scheduler;
+  PriorityClasses priorities;
 };
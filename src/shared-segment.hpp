@@ -1,8 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <limits>
 #include <memory>
 
 #include "versioned-lock.hpp"
@@ -14,32 +18,57 @@ struct ObjectVersion {
 
   ObjectVersion(std::unique_ptr<char[]> buf) : buf(std::move(buf)) {}
 
+  // Version of a word written in place by a transaction that hasn't committed
+  // yet. Newer than any snapshot, so readers skip over it.
+  static constexpr VersionedLock::Timestamp PENDING =
+      std::numeric_limits<VersionedLock::Timestamp>::max();
+
   std::unique_ptr<char[]> buf;
-  VersionedLock::Timestamp version = 0;
+  // Atomic because eager writers stamp it after the version is published
+  std::atomic<VersionedLock::Timestamp> version{0};
   ObjectVersion* earlier = nullptr;
 
-  void read(char* dst, std::size_t size) const noexcept {
-    std::memcpy(dst, buf.get(), size);
+  // `offset` is where the word lies in a page version, 0 in a word's own
+  void read(char* dst, std::size_t size,
+            std::size_t offset = 0) const noexcept {
+    std::memcpy(dst, buf.get() + offset, size);
   }
 
-  void write(const char* src, std::size_t size) const noexcept {
-    std::memcpy(buf.get(), src, size);
+  void write(const char* src, std::size_t size,
+             std::size_t offset = 0) const noexcept {
+    std::memcpy(buf.get() + offset, src, size);
   }
 };
 
+// The versions of a word, or of a whole page in paged segments. Locks are
+// per word either way, in the segment's lock table.
 struct Object {
-  VersionedLock lock;
   std::atomic<ObjectVersion*> latest{nullptr};
 };
 
+// Offset of a word from the start of its region's address range. Segments
+// are laid out SEGMENT_SHIFT bits apart, so the segment is the high bits.
 struct ObjectId {
-  std::uint8_t segment : 8;
-  std::size_t unused : 1;
-  std::size_t offset : 55;
+  static constexpr unsigned SEGMENT_SHIFT = 34;
+  static constexpr std::size_t OFFSET_MASK = (1ul << SEGMENT_SHIFT) - 1;
+
+  static ObjectId of(std::uint8_t segment, std::size_t offset) noexcept {
+    return ObjectId{(std::size_t(segment) << SEGMENT_SHIFT) | offset};
+  }
+
+  [[nodiscard]] std::uint8_t segment() const noexcept {
+    return bits >> SEGMENT_SHIFT;
+  }
+
+  [[nodiscard]] std::size_t offset() const noexcept {
+    return bits & OFFSET_MASK;
+  }
+
+  std::size_t bits;
 };
 
 inline ObjectId& operator+=(ObjectId& id, std::size_t offset) noexcept {
-  id.offset += offset;
+  id.bits += offset;
   return id;
 }
 
@@ -47,29 +76,11 @@ inline ObjectId operator+(ObjectId id, std::size_t offset) noexcept {
   return id += offset;
 }
 
-inline std::size_t opaque(ObjectId id) {
-  static_assert(sizeof(ObjectId) == sizeof(void*),
-                "Size of ObjectId does not match size of void*");
-
-  return (std::size_t(id.segment) << 56) | (1ul << 55) | id.offset;
-}
-
-inline ObjectId to_object_id(const void* id) noexcept {
-  static constexpr std::size_t OFFSET_MASK = (1ul << 55) - 1;
-  static constexpr std::size_t SEGMENT_MASK = (1ul << 8) - 1;
-
-  static_assert(sizeof(ObjectId) == sizeof(void*),
-                "Size of ObjectId does not match size of void*");
-
-  auto bytes = reinterpret_cast<std::size_t>(id);
-  std::size_t offset = bytes & OFFSET_MASK;
-  std::uint8_t segment = (bytes >> 56) & SEGMENT_MASK;
-
-  return ObjectId{segment, 1, offset};
-}
+// Orders words by address
+inline std::size_t opaque(ObjectId id) { return id.bits; }
 
 inline bool operator==(const ObjectId& a, const ObjectId& b) noexcept {
-  return a.segment == b.segment && a.offset == b.offset;
+  return a.bits == b.bits;
 }
 
 class SharedSegment {
@@ -81,39 +92,148 @@ public:
 
   ~SharedSegment() { deallocate(); }
 
-  void allocate(std::size_t size, std::size_t algn) {
+  // Words per lock of coarse tables, as a shift
+  static constexpr unsigned COARSE_SHIFT = 3;
+  // Words per lock table, as a shift: each table picks its granularity on
+  // its own conflicts, and switches holding only its locks
+  static constexpr unsigned TABLE_SHIFT = 9;
+  // Bytes per version of paged segments
+  static constexpr std::size_t PAGE_SIZE = 4096;
+
+  void allocate(std::size_t size, std::size_t algn, bool paged) {
     align = algn;
     num_objects = size / align;
-    objects = std::make_unique<Object[]>(num_objects);
-    for (auto i = 0ul; i < num_objects; ++i) {
-      objects[i].latest.store(new ObjectVersion(align),
+    unit_shift = 0;
+    while ((std::size_t(1) << unit_shift) <
+           (paged ? std::max(align, PAGE_SIZE) : align)) {
+      unit_shift += 1;
+    }
+    num_units = ((num_objects * align - 1) >> unit_shift) + 1;
+    objects = std::make_unique<Object[]>(num_units);
+    for (auto i = 0ul; i < num_units; ++i) {
+      objects[i].latest.store(new ObjectVersion(unit_size()),
                               std::memory_order_relaxed);
     }
+    num_tables = ((num_objects - 1) >> TABLE_SHIFT) + 1;
+    tables = std::make_unique<std::atomic<std::uintptr_t>[]>(num_tables);
+    checks = std::make_unique<TableCheck[]>(num_tables);
+    for (std::size_t t = 0; t < num_tables; ++t) {
+      auto* table = new VersionedLock[lock_count(t, 0)];
+      tables[t].store(reinterpret_cast<std::uintptr_t>(table),
+                      std::memory_order_release);
+    }
   }
 
   void deallocate() {
-    for (auto i = 0ul; i < num_objects; ++i) {
+    for (auto i = 0ul; i < num_units; ++i) {
       auto version = objects[i].latest.load();
       delete version;
     }
     objects.reset();
+    for (std::size_t t = 0; t < num_tables; ++t) {
+      delete[] table_of(tables[t].load(std::memory_order_relaxed));
+    }
+    tables.reset();
+    checks.reset();
+    num_tables = 0;
     num_objects = 0;
+    num_units = 0;
+    next_table = 0;
     should_delete.clear();
   }
 
+  // Lock of the `idx`th word
+  [[nodiscard]] VersionedLock& lock(std::size_t idx) noexcept {
+    auto table = tables[idx >> TABLE_SHIFT].load(std::memory_order_acquire);
+    return table_of(table)[(idx & TABLE_MASK) >> (table & SHIFT_MASK)];
+  }
+
+  // Whether the table of the `idx`th word is being switched, holding all of
+  // its locks for the time being
+  [[nodiscard]] bool switching(std::size_t idx) const noexcept {
+    return tables[idx >> TABLE_SHIFT].load(std::memory_order_acquire) &
+           SWITCHING;
+  }
+
+  // Whether the `idx`th word shares its lock
+  [[nodiscard]] bool coarse(std::size_t idx) const noexcept {
+    return (tables[idx >> TABLE_SHIFT].load(std::memory_order_acquire) &
+            SHIFT_MASK) != 0;
+  }
+
+  // Counts a conflict on the `idx`th word, for the granularity of its table
+  void conflict(std::size_t idx) noexcept {
+    checks[idx >> TABLE_SHIFT].conflicts.fetch_add(1,
+                                                   std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] std::size_t table_count() const noexcept { return num_tables; }
+
+  // Words per lock of the `t`th table, as a shift
+  [[nodiscard]] unsigned shift_of(std::size_t t) const noexcept {
+    return unsigned(tables[t].load(std::memory_order_relaxed) & SHIFT_MASK);
+  }
+
+  // Switches the `t`th table to one lock per 2^shift words, once it holds
+  // all of its locks. Returns the table replaced: its locks stay locked, so
+  // that whoever still looks at them fails until it's reclaimed. Null if
+  // some lock was busy.
+  std::unique_ptr<VersionedLock[]> regranulate(std::size_t t,
+                                               unsigned shift) {
+    const auto current = tables[t].load(std::memory_order_relaxed);
+    const auto old_shift = unsigned(current & SHIFT_MASK);
+    auto* old = table_of(current);
+    auto next = std::make_unique<VersionedLock[]>(lock_count(t, shift));
+    tables[t].store(current | SWITCHING, std::memory_order_relaxed);
+    for (std::size_t i = 0; i < lock_count(t, old_shift); ++i) {
+      if (!old[i].try_lock(VersionedLock::ANY_VERSION)) {
+        while (i-- > 0) {
+          old[i].unlock();
+        }
+        tables[t].store(current, std::memory_order_release);
+        return nullptr;
+      }
+    }
+
+    // A word's lock never goes back in version: validation stays
+    // conservative across the switch
+    const auto words = words_in(t);
+    for (std::size_t i = 0; i < lock_count(t, shift); ++i) {
+      auto first = (i << shift) >> old_shift;
+      auto last = std::min(((i + 1) << shift) - 1, words - 1) >> old_shift;
+      VersionedLock::Timestamp version = 0;
+      for (auto j = first; j <= last; ++j) {
+        version = std::max(version, old[j].version());
+      }
+      next[i].reset(version);
+    }
+    tables[t].store(reinterpret_cast<std::uintptr_t>(next.release()) | shift,
+                    std::memory_order_release);
+    return std::unique_ptr<VersionedLock[]>(old);
+  }
+
   // Returns true if marking succeeded
   bool mark_for_deletion() { return !should_delete.test_and_set(); }
 
   void cancel_deletion() { return should_delete.clear(); }
 
-  [[nodiscard]] Object& operator[](std::size_t idx) noexcept {
-    return objects[idx];
+  // Versions holding the word at byte `offset`
+  [[nodiscard]] Object& unit_of(std::size_t offset) noexcept {
+    return objects[offset >> unit_shift];
   }
 
-  [[nodiscard]] const Object& operator[](std::size_t idx) const noexcept {
-    return objects[idx];
+  // Where the word at byte `offset` lies in its versions
+  [[nodiscard]] std::size_t offset_in_unit(std::size_t offset) const noexcept {
+    return offset & (unit_size() - 1);
   }
 
+  // Bytes per version: the alignment, or a page
+  [[nodiscard]] std::size_t unit_size() const noexcept {
+    return std::size_t(1) << unit_shift;
+  }
+
+  [[nodiscard]] bool paged() const noexcept { return unit_size() != align; }
+
   [[nodiscard]] std::size_t size_bytes() const noexcept {
     return num_objects * align;
   }
@@ -121,5 +241,42 @@ public:
 private:
   std::atomic_flag should_delete = ATOMIC_FLAG_INIT;
   std::size_t num_objects = 0, align = 1;
+  std::size_t num_units = 0;
+  unsigned unit_shift = 0;
   std::unique_ptr<Object[]> objects = nullptr;
+  // Lock tables of 2^TABLE_SHIFT words each, the last one maybe less, with
+  // one lock per word or, once coarse, per 2^COARSE_SHIFT words. Each holds
+  // its shift in the low bits, and whether it's being switched: a single
+  // load.
+  static constexpr std::size_t TABLE_MASK = (std::size_t(1) << TABLE_SHIFT) - 1;
+  static constexpr std::uintptr_t SHIFT_MASK = 3, SWITCHING = 4;
+  static_assert(COARSE_SHIFT <= SHIFT_MASK);
+  static_assert(alignof(VersionedLock) > (SHIFT_MASK | SWITCHING));
+  std::unique_ptr<std::atomic<std::uintptr_t>[]> tables = nullptr;
+  std::size_t num_tables = 0;
+
+  [[nodiscard]] static VersionedLock* table_of(std::uintptr_t bits) noexcept {
+    return reinterpret_cast<VersionedLock*>(bits & ~(SHIFT_MASK | SWITCHING));
+  }
+
+  [[nodiscard]] std::size_t words_in(std::size_t t) const noexcept {
+    return std::min(num_objects - (t << TABLE_SHIFT), TABLE_MASK + 1);
+  }
+
+  [[nodiscard]] std::size_t lock_count(std::size_t t,
+                                       unsigned shift) const noexcept {
+    return ((words_in(t) - 1) >> shift) + 1;
+  }
+
+public:
+  // Per lock table: conflicts counted by the engine and, under the
+  // allocator's mutex, checks in a row that found none and splits back to
+  // one lock per word. Apart from `tables`, which every access reads.
+  struct TableCheck {
+    std::atomic<std::uint_fast32_t> conflicts{0};
+    unsigned quiet_periods = 0, splits = 0;
+  };
+  std::unique_ptr<TableCheck[]> checks = nullptr;
+  // Under the allocator's mutex: the table to check first next time
+  std::size_t next_table = 0;
 };
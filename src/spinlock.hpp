@@ -2,6 +2,13 @@
 
 #include <atomic>
 
+// Hint to the CPU that we are busy-waiting
+inline void cpu_relax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
 // Taken from
 // https://timur.audio/using-locks-in-real-time-audio-processing-safely
 class SpinLock {
@@ -12,7 +19,7 @@ public:
 
   void lock() noexcept {
     while (!try_lock()) {
-      // spin;
+      cpu_relax();
     }
   };
 
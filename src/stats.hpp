@@ -0,0 +1,129 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// Event counters for a region. Only updated when statistics were requested,
+// so that the shared cache line is not touched otherwise.
+class Stats {
+public:
+  using Counter = std::atomic<std::uint_fast64_t>;
+
+  explicit Stats(bool enabled) noexcept : enabled(enabled) {}
+
+  [[nodiscard]] bool active() const noexcept { return enabled; }
+
+  void count(Counter& counter) noexcept {
+    if (enabled) {
+      counter.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void print(std::ostream& out) const {
+    auto c = commits.load(std::memory_order_relaxed);
+    auto a = aborts.load(std::memory_order_relaxed);
+    out << "commits=" << c << " aborts=" << a
+        << " (lock=" << lock_aborts.load(std::memory_order_relaxed)
+        << ", validation=" << validation_aborts.load(std::memory_order_relaxed)
+        << ", escrow=" << escrow_aborts.load(std::memory_order_relaxed)
+        << ") commit_batches=" << commit_batches.load(std::memory_order_relaxed)
+        << " mispredicted_ro=" << mispredictions.load(std::memory_order_relaxed)
+        << " scope_rollbacks="
+        << scope_rollbacks.load(std::memory_order_relaxed)
+        << " value_validations="
+        << value_validations.load(std::memory_order_relaxed)
+        << " silent_stores=" << silent_stores.load(std::memory_order_relaxed)
+        << " regranulations="
+        << regranulations.load(std::memory_order_relaxed)
+        << " stale_locks=" << stale_locks.load(std::memory_order_relaxed)
+        << " page_copies=" << page_copies.load(std::memory_order_relaxed)
+        << " blocks_released="
+        << blocks_released.load(std::memory_order_relaxed)
+        << " abort_rate=" << (c + a == 0 ? 0.0 : double(a) / double(c + a))
+        << '\n';
+  }
+
+  Counter commits{0};
+  Counter aborts{0};
+  Counter lock_aborts{0};
+  Counter validation_aborts{0};
+  // A delta took its word out of bounds
+  Counter escrow_aborts{0};
+  Counter commit_batches{0};
+  Counter mispredictions{0};
+  // Conflicts that only rolled back a nested scope
+  Counter scope_rollbacks{0};
+  // Words rewritten since the snapshot that passed by still holding its value
+  Counter value_validations{0};
+  // Writes dropped at commit, for storing the value already there
+  Counter silent_stores{0};
+  // Lock tables switched to coarser or finer locks
+  Counter regranulations{0};
+  // Conflicts on a lock that a switch replaced since it was looked up
+  Counter stale_locks{0};
+  // Pages copied on write by commits to paged segments
+  Counter page_copies{0};
+  // Freed segments NOrec released once no transaction could still read them
+  Counter blocks_released{0};
+
+private:
+  bool enabled;
+};
+
+// Distribution of durations in nanoseconds, in buckets an eighth of a power
+// of two wide
+class LatencyHistogram {
+public:
+  using Counter = std::atomic<std::uint_fast64_t>;
+
+  void record(std::uint64_t ns) noexcept {
+    buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] std::uint64_t count() const noexcept {
+    std::uint64_t total = 0;
+    for (auto& counter : buckets) {
+      total += counter.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  // Lower bound of the bucket holding the `quantile`th duration
+  [[nodiscard]] std::uint64_t percentile(double quantile) const noexcept {
+    auto total = count();
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < BUCKETS; ++i) {
+      seen += buckets[i].load(std::memory_order_relaxed);
+      if (seen != 0 && double(seen) >= quantile * double(total)) {
+        return lower_bound(i);
+      }
+    }
+    return 0;
+  }
+
+private:
+  static constexpr unsigned SUB_BITS = 3;
+  static constexpr std::size_t SUB = std::size_t(1) << SUB_BITS;
+  static constexpr std::size_t BUCKETS = 64 * SUB;
+
+  static std::size_t bucket(std::uint64_t ns) noexcept {
+    if (ns < SUB) {
+      return ns;
+    }
+    unsigned exp = 63 - __builtin_clzll(ns);
+    return (exp - SUB_BITS + 1) * SUB + ((ns >> (exp - SUB_BITS)) & (SUB - 1));
+  }
+
+  static std::uint64_t lower_bound(std::size_t bucket) noexcept {
+    if (bucket < SUB) {
+      return bucket;
+    }
+    unsigned exp = bucket / SUB + SUB_BITS - 1;
+    return std::uint64_t(SUB + bucket % SUB) << (exp - SUB_BITS);
+  }
+
+  std::array<Counter, BUCKETS> buckets{};
+};
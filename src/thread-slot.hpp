@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <bitset>
+#include <cstddef>
+#include <mutex>
+
+// Small dense index for the calling thread, reused once the thread exits.
+// Lets regions keep per-thread state in plain arrays.
+class ThreadSlot {
+public:
+  static constexpr std::size_t MAX_THREADS = 256;
+  // Returned when more than MAX_THREADS threads are alive at once
+  static constexpr std::size_t NONE = MAX_THREADS;
+
+  [[nodiscard]] static std::size_t index() noexcept { return current.idx; }
+
+  // Upper bound on any index handed out so far
+  [[nodiscard]] static std::size_t high_water() noexcept {
+    return used_up_to.load(std::memory_order_acquire);
+  }
+
+  ThreadSlot(const ThreadSlot&) = delete;
+  ThreadSlot& operator=(const ThreadSlot&) = delete;
+
+private:
+  ThreadSlot() noexcept {
+    std::unique_lock lock(mutex);
+    while (idx < MAX_THREADS && taken[idx]) {
+      idx++;
+    }
+    if (idx < MAX_THREADS) {
+      taken[idx] = true;
+      if (used_up_to.load(std::memory_order_relaxed) <= idx) {
+        used_up_to.store(idx + 1, std::memory_order_release);
+      }
+    }
+  }
+
+  ~ThreadSlot() {
+    std::unique_lock lock(mutex);
+    if (idx < MAX_THREADS) {
+      taken[idx] = false;
+    }
+  }
+
+  std::size_t idx = 0;
+
+  static inline std::mutex mutex;
+  static inline std::bitset<MAX_THREADS> taken;
+  static inline std::atomic<std::size_t> used_up_to{0};
+  static thread_local ThreadSlot current;
+};
+
+inline thread_local ThreadSlot ThreadSlot::current;
@@ -24,9 +24,12 @@
 
 // External headers
 #include <iostream>
+#include <type_traits>
+#include <variant>
 
 // Internal headers
-#include "shared-memory.hpp"
+#include "region.hpp"
+#include "tm-ext.hpp"
 #include "tm.hpp"
 
 // -------------------------------------------------------------------------- //
@@ -61,13 +64,32 @@
 #warning This compiler has no support for GCC attributes
 #endif
 
-shared_t opaque(SharedMemory* mem) { return reinterpret_cast<shared_t>(mem); }
-tx_t opaque(Transaction* tx) { return reinterpret_cast<tx_t>(tx); }
+shared_t opaque(Region* region) { return reinterpret_cast<shared_t>(region); }
+template <typename Tx> tx_t opaque(Tx* tx) {
+  return reinterpret_cast<tx_t>(tx);
+}
+
+Region* transparent(shared_t shared) {
+  return reinterpret_cast<Region*>(shared);
+}
 
-SharedMemory* transparent(shared_t shared) {
-  return reinterpret_cast<SharedMemory*>(shared);
+// Calls `func` with the engine behind the region
+template <typename Func> decltype(auto) visit(shared_t shared, Func&& func) {
+  return std::visit(std::forward<Func>(func), *transparent(shared));
+}
+
+// The engine's transaction behind a transaction handle
+template <typename Memory> auto* transparent(Memory&, tx_t tx) {
+  return reinterpret_cast<typename Memory::Tx*>(tx);
+}
+
+// After an operation failed: the transaction is over, unless it failed inside
+// a nested scope, in which case tm_end_nested says how it ended
+template <typename Memory, typename Tx> void discard(Memory& mem, Tx* tx) {
+  if (!mem.nested(*tx)) {
+    delete tx;
+  }
 }
-Transaction* transparent(tx_t tx) { return reinterpret_cast<Transaction*>(tx); }
 
 // -------------------------------------------------------------------------- //
 /** Create (i.e. allocate + init) a new shared memory region, with one
@@ -80,7 +102,7 @@ Transaction* transparent(tx_t tx) { return reinterpret_cast<Transaction*>(tx); }
  * @return Opaque shared memory region handle, 'invalid_shared' on failure
  **/
 shared_t tm_create(size_t size, size_t align) noexcept {
-  return opaque(new SharedMemory(size, align));
+  return opaque(make_region(size, align, Config::from_env()));
 }
 
 /** Destroy (i.e. clean-up + free) a given shared memory region.
@@ -94,8 +116,7 @@ void tm_destroy(shared_t shared) noexcept { delete transparent(shared); }
  * @return Start address of the first allocated segment
  **/
 void* tm_start(shared_t shared) noexcept {
-  auto addr = transparent(shared)->start_addr();
-  return reinterpret_cast<void*>(opaque(addr));
+  return visit(shared, [](auto& mem) { return mem.start_addr(); });
 }
 
 /** [thread-safe] Return the size (in bytes) of the first allocated segment of
@@ -104,8 +125,7 @@ void* tm_start(shared_t shared) noexcept {
  * @return First allocated segment size
  **/
 size_t tm_size(shared_t shared) noexcept {
-  auto ret = transparent(shared)->size();
-  return ret;
+  return visit(shared, [](auto& mem) { return mem.size(); });
 }
 
 /** [thread-safe] Return the alignment (in bytes) of the memory accesses on the
@@ -114,7 +134,7 @@ size_t tm_size(shared_t shared) noexcept {
  * @return Alignment used globally
  **/
 size_t tm_align(shared_t shared) noexcept {
-  return transparent(shared)->alignment();
+  return visit(shared, [](auto& mem) { return mem.alignment(); });
 }
 
 /** [thread-safe] Begin a new transaction on the given shared memory region.
@@ -125,7 +145,149 @@ size_t tm_align(shared_t shared) noexcept {
 tx_t tm_begin(shared_t shared, bool is_ro) noexcept {
   // std::cout << "Starting new " << (is_ro ? "readonly" : "writable") << "
   // tx\n";
-  return opaque(new Transaction(transparent(shared)->begin_tx(is_ro)));
+  return visit(shared, [&](auto& mem) {
+    using Tx = typename std::decay_t<decltype(mem)>::Tx;
+    return opaque(new Tx(mem.begin_tx(is_ro)));
+  });
+}
+
+/** [thread-safe] Begin a new transaction on the given shared memory region,
+ *from the given call site. Once a site's read-write transactions commit
+ *without writing several times in a row, the MVCC engine starts the next ones
+ *as read-only; one that then writes, allocates or frees is aborted, and the
+ *site's retry runs read-write again.
+ * @param shared Shared memory region to start a transaction on
+ * @param is_ro  Whether the transaction is read-only
+ * @param site   Any address unique to the call site, e.g. of a static local
+ *variable there. Null for none: the transaction is then never inferred
+ *read-only, as with tm_begin.
+ * @return Opaque transaction ID, 'invalid_tx' on failure
+ **/
+tx_t tm_begin_at(shared_t shared, bool is_ro, void const* site) noexcept {
+  return visit(shared, [&](auto& mem) {
+    using Tx = typename std::decay_t<decltype(mem)>::Tx;
+    return opaque(new Tx(mem.begin_tx(is_ro, site)));
+  });
+}
+
+/** [thread-safe] Begin a new read-write transaction under snapshot isolation:
+ *it reads from the snapshot it started on, and only aborts if it writes a
+ *word somebody else committed since then. Concurrent transactions may then
+ *commit based on each other's stale reads (write skew).
+ * @param shared Shared memory region to start a transaction on
+ * @return Opaque transaction ID, 'invalid_tx' on failure
+ **/
+tx_t tm_begin_si(shared_t shared) noexcept {
+  return visit(shared, [&](auto& mem) {
+    using Tx = typename std::decay_t<decltype(mem)>::Tx;
+    return opaque(new Tx(mem.begin_si()));
+  });
+}
+
+/** [thread-safe] Begin a new transaction of the given priority class. High
+ *priority transactions wait for busy locks instead of aborting, and low
+ *priority ones are deferred while high priority ones run. Only the MVCC
+ *engine acts on priorities; with TM_STATS, it reports per-class latencies.
+ * @param shared    Shared memory region to start a transaction on
+ * @param is_ro     Whether the transaction is read-only
+ * @param priority  Priority class of the transaction
+ * @param budget_ns Latency budget in nanoseconds, 0 for none, counted from
+ *the first attempt when the transaction is retried on the same thread.
+ *Attempts that begin past it are favoured like high priority ones.
+ * @return Opaque transaction ID, 'invalid_tx' on failure
+ **/
+tx_t tm_begin_priority(shared_t shared, bool is_ro, Priority priority,
+                       uint64_t budget_ns) noexcept {
+  return visit(shared, [&](auto& mem) {
+    using Tx = typename std::decay_t<decltype(mem)>::Tx;
+    return opaque(
+        new Tx(mem.begin_tx(is_ro, nullptr, priority, budget_ns)));
+  });
+}
+
+/** [thread-safe] Begin a new transaction for a caller that suspends it rather
+ *than block its thread, e.g. a coroutine sharing the thread with others. It
+ *never waits to begin (see TM_SCHEDULE and TM_VERSIONING=adaptive), nor for a
+ *busy lock: it aborts at once, and tm_conflict tells on which word.
+ * @param shared Shared memory region to start a transaction on
+ * @param is_ro  Whether the transaction is read-only
+ * @return Opaque transaction ID, 'invalid_tx' on failure
+ **/
+tx_t tm_begin_suspendable(shared_t shared, bool is_ro) noexcept {
+  return visit(shared, [&](auto& mem) {
+    using Tx = typename std::decay_t<decltype(mem)>::Tx;
+    return opaque(new Tx(mem.begin_suspendable(is_ro)));
+  });
+}
+
+/** [thread-safe] Tell on which word the calling thread's latest transaction
+ *from tm_begin_suspendable aborted, so that its caller can wait for the word's
+ *lock with tm_locked before retrying.
+ * @param shared Shared memory region the transaction ran on
+ * @return Address of the word (in the shared region), null if it committed or
+ *aborted for another reason, or with an engine that doesn't track conflicts
+ *(TM_ENGINE=norec)
+ **/
+void const* tm_conflict(shared_t shared) noexcept {
+  return visit(shared, [&](auto& mem) { return mem.conflict(); });
+}
+
+/** [thread-safe] Tell whether a transaction holds the lock of the given word.
+ * @param shared Shared memory region of the word
+ * @param word   Address of the word (in the shared region)
+ * @return Whether the word's lock is held, false once its segment was freed
+ *and always with TM_ENGINE=norec
+ **/
+bool tm_locked(shared_t shared, void const* word) noexcept {
+  return visit(shared, [&](auto& mem) { return mem.locked(word); });
+}
+
+/** [thread-safe] Share the snapshot of the given read-only transaction, so
+ *that transactions on other threads can read the very same state, e.g. to
+ *scan disjoint segments in parallel. The snapshot outlives the transaction,
+ *and keeps what it reads from being reclaimed until released.
+ * @param shared Shared memory region associated with the transaction
+ * @param tx     Read-only transaction to share the snapshot of
+ * @return Opaque snapshot handle, 'invalid_snapshot' for a read-write
+ *transaction or an engine without versions (TM_ENGINE=norec)
+ **/
+snapshot_t tm_export_snapshot(shared_t shared, tx_t tx) noexcept {
+  return visit(shared, [&](auto& mem) -> snapshot_t {
+    return mem.export_snapshot(*transparent(mem, tx));
+  });
+}
+
+/** [thread-safe] Begin a new read-only transaction reading the given
+ *snapshot. It never aborts, like any read-only transaction.
+ * @param shared   Shared memory region the snapshot was exported from
+ * @param snapshot Snapshot to read, not released yet
+ * @return Opaque transaction ID, 'invalid_tx' on failure
+ **/
+tx_t tm_begin_snapshot(shared_t shared, snapshot_t snapshot) noexcept {
+  if (unlikely(snapshot == invalid_snapshot)) {
+    return invalid_tx;
+  }
+  return visit(shared, [&](auto& mem) {
+    using Memory = std::decay_t<decltype(mem)>;
+    using Tx = typename Memory::Tx;
+    auto* shared_snapshot = static_cast<typename Memory::Snapshot*>(snapshot);
+    return opaque(new Tx(mem.begin_at(*shared_snapshot)));
+  });
+}
+
+/** [thread-safe] Release the given snapshot. Transactions begun from it may
+ *still run until they end.
+ * @param shared   Shared memory region the snapshot was exported from
+ * @param snapshot Snapshot to release
+ **/
+void tm_release_snapshot(shared_t shared, snapshot_t snapshot) noexcept {
+  if (snapshot == invalid_snapshot) {
+    return;
+  }
+  visit(shared, [&](auto& mem) {
+    using Memory = std::decay_t<decltype(mem)>;
+    mem.release_snapshot(static_cast<typename Memory::Snapshot*>(snapshot));
+  });
 }
 
 /** [thread-safe] End the given transaction.
@@ -134,11 +296,42 @@ tx_t tm_begin(shared_t shared, bool is_ro) noexcept {
  * @return Whether the whole transaction committed
  **/
 bool tm_end(shared_t shared, tx_t tx) noexcept {
-  // std::cout << "Committing tx ";
-  bool success = transparent(shared)->end_tx(*transparent(tx));
-  // std::cout << (success ? "succeeded" : "failed") << '\n';
-  delete transparent(tx);
-  return success;
+  return visit(shared, [&](auto& mem) {
+    auto* transaction = transparent(mem, tx);
+    // std::cout << "Committing tx ";
+    bool success = mem.end_tx(*transaction);
+    // std::cout << (success ? "succeeded" : "failed") << '\n';
+    delete transaction;
+    return success;
+  });
+}
+
+/** [thread-safe] Open a closed nested scope in the given transaction. Inside
+ *it, an operation that returns false doesn't end the transaction: the scope is
+ *over, and tm_end_nested must be called to know how it ended.
+ * @param shared Shared memory region associated with the transaction
+ * @param tx     Transaction to use
+ **/
+void tm_begin_nested(shared_t shared, tx_t tx) noexcept {
+  visit(shared,
+        [&](auto& mem) { mem.begin_nested(*transparent(mem, tx)); });
+}
+
+/** [thread-safe] Close the innermost nested scope of the given transaction.
+ * @param shared Shared memory region associated with the transaction
+ * @param tx     Transaction to use
+ * @return Whether the scope was merged into the enclosing transaction, rolled
+ *back alone (the scope may be run again), or the whole transaction aborted
+ **/
+Scope tm_end_nested(shared_t shared, tx_t tx) noexcept {
+  return visit(shared, [&](auto& mem) {
+    auto* transaction = transparent(mem, tx);
+    auto scope = mem.end_nested(*transaction);
+    if (scope == Scope::aborted) {
+      delete transaction;
+    }
+    return scope;
+  });
 }
 
 /** [thread-safe] Read operation in the given transaction, source in the shared
@@ -153,24 +346,14 @@ bool tm_end(shared_t shared, tx_t tx) noexcept {
  **/
 bool tm_read(shared_t shared, tx_t tx, void const* source, size_t size,
              void* target) noexcept {
-  auto* tm = transparent(shared);
-  auto* dest = reinterpret_cast<char*>(target);
-
-  auto start = to_object_id(source);
-  std::size_t offset = 0;
-  auto align = tm->alignment();
-  // std::cout << "Original source ptr=" << source << '\n';
-  // std::cout << "Reading :: size=" << size << ", start=" << start.offset
-  //          << ", segment=" << +start.segment << ", align=" << align << '\n';
-  while (offset < size) {
-    if (tm->read_word(*transparent(tx), start + offset, dest + offset) ==
-        false) {
-      delete transparent(tx);
+  return visit(shared, [&](auto& mem) {
+    auto* transaction = transparent(mem, tx);
+    if (!mem.read(*transaction, source, size, target)) {
+      discard(mem, transaction);
       return false;
     }
-    offset += align;
-  }
-  return true;
+    return true;
+  });
 }
 
 /** [thread-safe] Write operation in the given transaction, source in a private
@@ -185,26 +368,143 @@ bool tm_read(shared_t shared, tx_t tx, void const* source, size_t size,
  **/
 bool tm_write(shared_t shared, tx_t tx, void const* source, size_t size,
               void* target) noexcept {
-  auto* tm = transparent(shared);
-  const auto* src = reinterpret_cast<const char*>(source);
+  return visit(shared, [&](auto& mem) {
+    auto* transaction = transparent(mem, tx);
+    if (!mem.write(*transaction, source, size, target)) {
+      discard(mem, transaction);
+      return false;
+    }
+    return true;
+  });
+}
 
-  auto start = to_object_id(target);
+/** [thread-safe] Read several ranges in the given transaction, in one call.
+ * @param shared   Shared memory region associated with the transaction
+ * @param tx       Transaction to use
+ * @param accesses Ranges to read, each from `shared` into `buffer`
+ * @param count    Number of ranges
+ * @return Whether the whole transaction can continue
+ **/
+bool tm_read_many(shared_t shared, tx_t tx, Access const* accesses,
+                  size_t count) noexcept {
+  return visit(shared, [&](auto& mem) {
+    auto* transaction = transparent(mem, tx);
+    if (!mem.read_many(*transaction, accesses, count)) {
+      discard(mem, transaction);
+      return false;
+    }
+    return true;
+  });
+}
 
-  std::size_t offset = 0;
-  auto align = tm->alignment();
+/** [thread-safe] Write several ranges in the given transaction, in one call.
+ * @param shared   Shared memory region associated with the transaction
+ * @param tx       Transaction to use
+ * @param accesses Ranges to write, each from `buffer` into `shared`
+ * @param count    Number of ranges
+ * @return Whether the whole transaction can continue
+ **/
+bool tm_write_many(shared_t shared, tx_t tx, Access const* accesses,
+                   size_t count) noexcept {
+  return visit(shared, [&](auto& mem) {
+    auto* transaction = transparent(mem, tx);
+    if (!mem.write_many(*transaction, accesses, count)) {
+      discard(mem, transaction);
+      return false;
+    }
+    return true;
+  });
+}
 
-  // std::cout << "Original target ptr=" << target << '\n';
-  // std::cout << "Writing :: size=" << size << ", start=" << start.offset
-  //           << ", segment=" << +start.segment << ", align=" << align << '\n';
-  while (offset < size) {
-    if (tm->write_word(*transparent(tx), src + offset, start + offset) ==
-        false) {
-      delete transparent(tx);
+/** [thread-safe] Read operation in the given transaction that points at the
+ *transaction's snapshot instead of copying into a private region, where it
+ *can: in a read-only transaction, within one word or within one page of a
+ *segment of at least TM_PAGE_SEGMENTS bytes. Other ranges are copied into
+ *memory the transaction keeps, as tm_read would.
+ * @param shared Shared memory region associated with the transaction
+ * @param tx     Transaction to use
+ * @param source Source start address (in the shared region)
+ * @param size   Length to view (in bytes), must be a positive multiple of the
+ *alignment
+ * @return Read-only view of the range, valid until the transaction ends, or
+ *null if the transaction cannot continue
+ **/
+void const* tm_read_view(shared_t shared, tx_t tx, void const* source,
+                         size_t size) noexcept {
+  return visit(shared, [&](auto& mem) {
+    auto* transaction = transparent(mem, tx);
+    auto* view = mem.read_view(*transaction, source, size);
+    if (view == nullptr) {
+      discard(mem, transaction);
+    }
+    return view;
+  });
+}
+
+/** [thread-safe] Commutative addition in the given transaction: the delta is
+ *added to the word's latest value at commit, without reading it, so
+ *concurrent additions to the same word don't conflict.
+ * @param shared Shared memory region associated with the transaction
+ * @param tx     Transaction to use
+ * @param target Address of the word (in the shared region), a signed integer
+ *of the alignment's size, which must be 1, 2, 4 or 8
+ * @param delta  Amount to add
+ * @param min    Lowest value the word may end up with (INT64_MIN for none)
+ * @param max    Highest value the word may end up with (INT64_MAX for none)
+ * @return Whether the whole transaction can continue; a commit that would
+ *take the word out of bounds fails. In a region of another alignment, the
+ *transaction is aborted and false returned.
+ **/
+bool tm_add(shared_t shared, tx_t tx, void* target, int64_t delta, int64_t min,
+            int64_t max) noexcept {
+  return visit(shared, [&](auto& mem) {
+    auto* transaction = transparent(mem, tx);
+    if (!mem.add(*transaction, target, Delta{delta, min, max})) {
+      discard(mem, transaction);
       return false;
     }
-    offset += align;
-  }
-  return true;
+    return true;
+  });
+}
+
+/** [thread-safe] Read one word outside of any transaction, as a read-only
+ *transaction of its own would, but without beginning one.
+ * @param shared Shared memory region to read from
+ * @param source Address of the word (in the shared region)
+ * @param target Target address (in a private region), of the alignment's size
+ **/
+void tm_atomic_load(shared_t shared, void const* source,
+                    void* target) noexcept {
+  visit(shared, [&](auto& mem) { mem.atomic_load(source, target); });
+}
+
+/** [thread-safe] Write one word outside of any transaction. Gives up if a
+ *transaction the calling thread hasn't ended holds the word's lock.
+ * @param shared Shared memory region to write to
+ * @param source Source address (in a private region), of the alignment's size
+ * @param target Address of the word (in the shared region)
+ * @return Whether the word was written
+ **/
+bool tm_atomic_store(shared_t shared, void const* source,
+                     void* target) noexcept {
+  return visit(shared,
+               [&](auto& mem) { return mem.atomic_store(source, target); });
+}
+
+/** [thread-safe] Compare-and-swap one word outside of any transaction. Gives up
+ *like tm_atomic_store, leaving `expected` as it was.
+ * @param shared   Shared memory region to update
+ * @param target   Address of the word (in the shared region)
+ * @param expected Value the word must hold (in a private region), receives the
+ *word's value if it doesn't
+ * @param desired  Value to store (in a private region)
+ * @return Whether the word held the expected value and was replaced
+ **/
+bool tm_atomic_cas(shared_t shared, void* target, void* expected,
+                   void const* desired) noexcept {
+  return visit(shared, [&](auto& mem) {
+    return mem.atomic_cas(target, expected, desired);
+  });
 }
 
 /** [thread-safe] Memory allocation in the given transaction.
@@ -219,13 +519,16 @@ bool tm_write(shared_t shared, tx_t tx, void const* source, size_t size,
  **/
 Alloc tm_alloc(shared_t shared, tx_t tx, size_t size, void** target) noexcept {
   // std::cout << "Alloc'ing to tx\n";
-  ObjectId addr;
-  bool success = transparent(shared)->allocate(*transparent(tx), size, &addr);
-  // std::cout << "Allocation " << (success ? "succeeded" : "failed") << '\n';
-  if (success) {
-    *target = reinterpret_cast<void*>(opaque(addr));
-  }
-  return success ? Alloc::success : Alloc::nomem;
+  return visit(shared, [&](auto& mem) {
+    auto* transaction = transparent(mem, tx);
+    if (!mem.writable(*transaction)) {
+      discard(mem, transaction);
+      return Alloc::abort;
+    }
+    bool success = mem.allocate(*transaction, size, target);
+    // std::cout << "Allocation " << (success ? "succeeded" : "failed") << '\n';
+    return success ? Alloc::success : Alloc::nomem;
+  });
 }
 
 /** [thread-safe] Memory freeing in the given transaction.
@@ -237,7 +540,13 @@ Alloc tm_alloc(shared_t shared, tx_t tx, size_t size, void** target) noexcept {
  **/
 bool tm_free(shared_t shared, tx_t tx, void* target) noexcept {
   // std::cout << "Free'ing to tx\n";
-  auto id = to_object_id(target);
-  transparent(shared)->free(*transparent(tx), id);
-  return true;
+  return visit(shared, [&](auto& mem) {
+    auto* transaction = transparent(mem, tx);
+    if (!mem.writable(*transaction)) {
+      discard(mem, transaction);
+      return false;
+    }
+    mem.free(*transaction, target);
+    return true;
+  });
 }
@@ -1,9 +1,18 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <optional>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "conflict-scheduler.hpp"
+#include "delta.hpp"
+#include "mode-switch.hpp"
 #include "shared-segment.hpp"
+#include "thread-slot.hpp"
+#include "view-arena.hpp"
 
 struct TransactionDescriptor {
   VersionedLock::Timestamp commit_time = 0;
@@ -14,16 +23,70 @@ struct TransactionDescriptor {
   TransactionDescriptor* next = nullptr;
 };
 
-struct Transaction {
+// A read-only transaction's snapshot, handed to others: its start time, and
+// a descriptor no later than that, which keeps what it reads from being
+// reclaimed
+struct SharedSnapshot {
+  VersionedLock::Timestamp start_time;
+  TransactionDescriptor* pin;
+};
+
+struct MvccTransaction {
   struct WriteEntry {
     ObjectId addr;
-    Object& obj;
+    Object* obj;
     std::unique_ptr<char[]> written;
+    // Set for a delta not yet added to the word; `written` is only filled in
+    // at commit, once the word is locked
+    std::optional<Delta> delta{};
+    // Savepoint that last saved this entry, see SavedEntry
+    std::size_t saved_in = 0;
+    // Taken at commit. Words may share a lock: only one entry releases it.
+    VersionedLock* lock = nullptr;
+    bool owns_lock = false;
   };
 
   struct ReadEntry {
     ObjectId addr;
-    Object& obj;
+    Object* obj;
+  };
+
+  // A word locked and written in place by an eager transaction: `pending` is
+  // the object's latest version, and its predecessor is the value to restore.
+  struct UndoEntry {
+    ObjectId addr;
+    Object* obj;
+    ObjectVersion* pending;
+    VersionedLock* lock;
+    // The first write under a lock takes it, the others find it taken
+    bool owns_lock;
+  };
+
+  // What the logs held when a closed nested scope began. Rolling the scope
+  // back truncates them to these sizes, then restores what was saved since.
+  struct Savepoint {
+    std::size_t id;
+    std::size_t write_set;
+    std::size_t read_set;
+    std::size_t undo_log;
+    std::size_t alloc_set;
+    std::size_t free_set;
+    std::size_t saved_entries;
+    std::size_t saved_words;
+  };
+
+  // A write entry from before the innermost savepoint, as it was before the
+  // scope first changed it
+  struct SavedEntry {
+    std::size_t index;
+    WriteEntry entry;
+  };
+
+  // A word written in place (in an owned segment or an eager transaction's
+  // pending version), as it was before
+  struct SavedWord {
+    char* word;
+    std::unique_ptr<char[]> bytes;
   };
 
   [[nodiscard]] WriteEntry* find_write_entry(ObjectId addr) noexcept {
@@ -35,11 +98,156 @@ struct Transaction {
     return nullptr;
   }
 
+  // The write set is only sorted at commit, so order doesn't matter here
+  void drop_write_entry(WriteEntry& entry) noexcept {
+    std::swap(entry, write_set.back());
+    write_set.pop_back();
+  }
+
+  // Whether the segment was allocated by this very transaction, and thus
+  // can't be reached by anyone else before it commits
+  [[nodiscard]] bool owns_segment(ObjectId addr) const noexcept {
+    for (auto segment : alloc_set) {
+      if (segment.segment() == addr.segment()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  [[nodiscard]] UndoEntry* find_undo_entry(ObjectId addr) noexcept {
+    if (!indexed()) {
+      for (auto& entry : undo_log) {
+        if (entry.addr == addr) {
+          return &entry;
+        }
+      }
+      return nullptr;
+    }
+    auto found = undo_entries.find(opaque(addr));
+    return found != undo_entries.end() ? &undo_log[found->second] : nullptr;
+  }
+
+  // How many eager writes are under the lock, taken for the first of them
+  [[nodiscard]] std::size_t eager_writes(
+      const VersionedLock& lock) const noexcept {
+    if (!indexed()) {
+      return std::count_if(
+          undo_log.begin(), undo_log.end(),
+          [&lock](const auto& entry) { return entry.lock == &lock; });
+    }
+    auto found = eager_locks.find(&lock);
+    return found != eager_locks.end() ? found->second : 0;
+  }
+
+  void log_undo(const UndoEntry& entry) {
+    undo_log.push_back(entry);
+    if (undo_log.size() == INDEX_UNDO_FROM + 1) {
+      reindex_undo_log();
+    } else if (indexed()) {
+      index_undo_entry(undo_log.size() - 1);
+    }
+  }
+
+  // Forgets the undo entries from `from` on, once undone
+  void truncate_undo_log(std::size_t from) {
+    if (from <= INDEX_UNDO_FROM) {
+      undo_log.resize(from);
+      undo_entries.clear();
+      eager_locks.clear();
+      return;
+    }
+    for (auto i = from; i < undo_log.size(); ++i) {
+      undo_entries.erase(opaque(undo_log[i].addr));
+      auto held = eager_locks.find(undo_log[i].lock);
+      if (--held->second == 0) {
+        eager_locks.erase(held);
+      }
+    }
+    undo_log.resize(from);
+  }
+
+  // Once undo_log was reordered
+  void reindex_undo_log() {
+    undo_entries.clear();
+    eager_locks.clear();
+    if (indexed()) {
+      for (std::size_t i = 0; i < undo_log.size(); ++i) {
+        index_undo_entry(i);
+      }
+    }
+  }
+
   bool is_ro;
-  TransactionDescriptor* start_point;
+  // Started read-only because its call site hasn't written in a while
+  bool inferred_ro = false;
+  // Stored values their words already held, which it only had to read
+  bool silent_stores = false;
+  // Snapshot isolation: reads come from start_time's snapshot and are never
+  // validated, only writes to words committed since then abort it
+  bool snapshot_isolation = false;
+  // Slot of the call site its caller named, 0 if none
+  std::size_t call_site = 0;
+  // Under adaptive versioning, read-write transactions took their mode from
+  // the mode switch
+  bool gated = false;
+  Mode mode = Mode::lazy;
+  // Read-write transactions went through the scheduler, and took these
+  // queues there
+  bool scheduled = false;
+  ConflictScheduler::Queues queues = 0;
+  // Word of the latest conflict
+  std::optional<ObjectId> conflict_on{};
+  // Run by a caller that suspends it rather than block its thread: never
+  // waits for a queue, the coarse mutex or a busy lock, and reports the
+  // word it aborted on
+  bool suspendable = false;
+  Priority priority = Priority::normal;
+  // Whether the start of the first attempt was taken, and when it was
+  bool timed = false;
+  std::uint64_t started = 0;
+  // High priority, or retried past its budget: counted among the
+  // high-priority transactions running
+  bool favoured = false;
+  // Pinned descriptor, or none if the start time was announced in a
+  // per-thread clock slot instead
+  TransactionDescriptor* start_point = nullptr;
+  std::size_t clock_slot = ThreadSlot::NONE;
+  // Listed in this thread's state as holding locks for eager writes, which
+  // its tm_atomic_* calls must not wait for
+  std::size_t eager_slot = ThreadSlot::NONE;
   VersionedLock::Timestamp start_time;
   std::vector<WriteEntry> write_set;
   std::vector<ReadEntry> read_set;
+  std::vector<UndoEntry> undo_log;
+  // Past INDEX_UNDO_FROM entries, the index of each word's undo entry, and
+  // how many entries are under each lock eager writes took
+  std::unordered_map<std::size_t, std::size_t> undo_entries;
+  std::unordered_map<const VersionedLock*, std::size_t> eager_locks;
   std::vector<ObjectId> alloc_set;
   std::vector<ObjectId> free_set;
+  ViewArena views;
+
+  // Open nested scopes, innermost last
+  std::vector<Savepoint> savepoints;
+  std::vector<SavedEntry> saved_entries;
+  std::vector<SavedWord> saved_words;
+  std::size_t next_savepoint = 1;
+  // The innermost scope was rolled back by a conflict
+  bool scope_failed = false;
+  // The whole transaction was rolled back
+  bool aborted = false;
+
+private:
+  // Short undo logs are cheaper to scan than to index
+  static constexpr std::size_t INDEX_UNDO_FROM = 16;
+
+  [[nodiscard]] bool indexed() const noexcept {
+    return undo_log.size() > INDEX_UNDO_FROM;
+  }
+
+  void index_undo_entry(std::size_t i) {
+    undo_entries[opaque(undo_log[i].addr)] = i;
+    eager_locks[undo_log[i].lock] += 1;
+  }
 };
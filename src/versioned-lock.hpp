@@ -3,11 +3,18 @@
 #include <atomic>
 #include <climits>
 #include <cstdint>
+#include <limits>
+
+#include "spinlock.hpp"
 
 class VersionedLock {
 public:
   using Timestamp = std::uint_fast32_t;
 
+  // For lockers whose write doesn't depend on the word's current value
+  static constexpr Timestamp ANY_VERSION =
+      std::numeric_limits<Timestamp>::max();
+
   [[nodiscard]] Timestamp version() const noexcept {
     return counter.load(std::memory_order_acquire) & VERSION_MASK;
   }
@@ -16,6 +23,12 @@ public:
     return counter.load(std::memory_order_acquire) & LOCKED_MASK;
   }
 
+  // The version of an unlocked word, ANY_VERSION while it's locked
+  [[nodiscard]] Timestamp stable_version() const noexcept {
+    auto current = counter.load(std::memory_order_acquire);
+    return current & LOCKED_MASK ? ANY_VERSION : current;
+  }
+
   [[nodiscard]] bool validate(Timestamp last_seen) noexcept {
     auto current = counter.load(std::memory_order_acquire);
     return !(current & LOCKED_MASK || (current & VERSION_MASK) > last_seen);
@@ -31,6 +44,36 @@ public:
         current, desired, std::memory_order_release, std::memory_order_relaxed);
   }
 
+  // Like try_lock, but waits up to `spin` rounds for a busy lock to be
+  // released: its holder is most likely already writing back.
+  [[nodiscard]] bool try_lock(Timestamp last_seen, unsigned spin) noexcept {
+    auto current = counter.load(std::memory_order_acquire);
+    while (true) {
+      if ((current & VERSION_MASK) > last_seen) {
+        return false;
+      }
+      if (current & LOCKED_MASK) {
+        if (spin-- == 0) {
+          return false;
+        }
+        cpu_relax();
+        current = counter.load(std::memory_order_acquire);
+        continue;
+      }
+      const auto desired = current | LOCKED_MASK;
+      if (counter.compare_exchange_weak(current, desired,
+                                        std::memory_order_acquire,
+                                        std::memory_order_acquire)) {
+        return true;
+      }
+    }
+  }
+
+  // Only for a lock nobody else can see yet
+  void reset(Timestamp version) noexcept {
+    counter.store(version, std::memory_order_relaxed);
+  }
+
   // This function can only be called if the current thread managed to lock!!
   void unlock() noexcept {
     counter.store(version(), std::memory_order_release);
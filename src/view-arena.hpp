@@ -0,0 +1,35 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Copies handed out by a transaction's read views, kept until it ends.
+// Carved out of blocks that double in size, so that a transaction taking
+// many views allocates a handful of times rather than once per view.
+class ViewArena {
+public:
+  static constexpr std::size_t FIRST_BLOCK = 4096;
+
+  // Room for `size` bytes. Views are multiples of the alignment, so each one
+  // is as aligned as the block.
+  char* allocate(std::size_t size) {
+    if (size > left) {
+      last = std::max(size, blocks.empty() ? FIRST_BLOCK : 2 * last);
+      next = blocks.emplace_back(std::make_unique<char[]>(last)).get();
+      left = last;
+    }
+    auto* chunk = next;
+    next += size;
+    left -= size;
+    return chunk;
+  }
+
+private:
+  std::vector<std::unique_ptr<char[]>> blocks;
+  char* next = nullptr;
+  std::size_t left = 0;
+  // Size of the latest block
+  std::size_t last = 0;
+};
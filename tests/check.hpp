@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+
+#include <tm-ext.hpp>
+
+// Stops the program at the first check that fails
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,    \
+                   #cond);                                                     \
+      std::exit(1);                                                            \
+    }                                                                          \
+  } while (false)
+
+// Whether the checks run against NOrec, see Config::from_env
+inline bool norec() {
+  const char* engine = std::getenv("TM_ENGINE");
+  return engine != nullptr && std::string_view(engine) == "norec";
+}
+
+// Address of the `index`-th word of the first segment
+inline std::uint64_t* word(shared_t shared, std::size_t index) {
+  return static_cast<std::uint64_t*>(tm_start(shared)) + index;
+}
+
+// Value of a word, in a read-only transaction of its own
+inline std::uint64_t load(shared_t shared, const std::uint64_t* addr) {
+  std::uint64_t value;
+  auto tx = tm_begin(shared, true);
+  CHECK(tm_read(shared, tx, addr, sizeof(value), &value));
+  CHECK(tm_end(shared, tx));
+  return value;
+}
+
+// Sets a word, in a read-write transaction of its own
+inline void store(shared_t shared, std::uint64_t* addr, std::uint64_t value) {
+  auto tx = tm_begin(shared, false);
+  CHECK(tm_write(shared, tx, &value, sizeof(value), addr));
+  CHECK(tm_end(shared, tx));
+}
@@ -0,0 +1,137 @@
+// Commutative additions with escrow bounds: tm_add
+
+#include <limits>
+
+#include "check.hpp"
+
+constexpr auto NO_MIN = std::numeric_limits<std::int64_t>::min();
+constexpr auto NO_MAX = std::numeric_limits<std::int64_t>::max();
+
+// Adds `delta` to the word in a transaction of its own, and tells whether it
+// committed
+static bool add(shared_t shared, std::uint64_t* addr, std::int64_t delta,
+                std::int64_t min = NO_MIN, std::int64_t max = NO_MAX) {
+  auto tx = tm_begin(shared, false);
+  return tm_add(shared, tx, addr, delta, min, max) && tm_end(shared, tx);
+}
+
+// Concurrent additions to the same word don't conflict
+static void commutes(shared_t shared) {
+  auto* x = word(shared, 0);
+  store(shared, x, 1);
+  auto first = tm_begin(shared, false);
+  auto second = tm_begin(shared, false);
+  CHECK(tm_add(shared, first, x, 5, NO_MIN, NO_MAX));
+  CHECK(tm_add(shared, second, x, 3, NO_MIN, NO_MAX));
+  CHECK(tm_end(shared, first));
+  CHECK(tm_end(shared, second));
+  CHECK(load(shared, x) == 9);
+
+  // The transaction reads its own additions
+  auto tx = tm_begin(shared, false);
+  CHECK(tm_add(shared, tx, x, -4, NO_MIN, NO_MAX));
+  std::uint64_t value;
+  CHECK(tm_read(shared, tx, x, sizeof(value), &value) && value == 5);
+  CHECK(tm_end(shared, tx));
+  CHECK(load(shared, x) == 5);
+}
+
+// A commit that would take the word out of its bounds fails and leaves it
+static void bounded(shared_t shared) {
+  auto* x = word(shared, 1);
+  store(shared, x, 10);
+  CHECK(!add(shared, x, -11, 0));
+  CHECK(!add(shared, x, 3, NO_MIN, 12));
+  CHECK(load(shared, x) == 10);
+  CHECK(add(shared, x, -10, 0));
+  CHECK(load(shared, x) == 0);
+  CHECK(add(shared, x, 12, NO_MIN, 12));
+  CHECK(load(shared, x) == 12);
+
+  // Bounds hold on the latest value, whatever the others committed since
+  auto first = tm_begin(shared, false);
+  auto second = tm_begin(shared, false);
+  CHECK(tm_add(shared, first, x, -7, 0, NO_MAX));
+  CHECK(tm_add(shared, second, x, -7, 0, NO_MAX));
+  CHECK(tm_end(shared, first));
+  CHECK(!tm_end(shared, second));
+  CHECK(load(shared, x) == 5);
+
+  // Two additions in one transaction: both bounds apply to the final value
+  auto tx = tm_begin(shared, false);
+  CHECK(tm_add(shared, tx, x, 3, NO_MIN, NO_MAX));
+  CHECK(!(tm_add(shared, tx, x, 3, NO_MIN, 10) && tm_end(shared, tx)));
+  CHECK(load(shared, x) == 5);
+
+  // After a plain write, the bounds apply right away
+  tx = tm_begin(shared, false);
+  std::uint64_t value = 1;
+  CHECK(tm_write(shared, tx, &value, sizeof(value), x));
+  CHECK(!tm_add(shared, tx, x, -2, 0, NO_MAX));
+  CHECK(load(shared, x) == 5);
+}
+
+// The word holds a signed integer of the alignment's size, whose range
+// bounds it too
+template <typename Int> static void sized() {
+  auto shared = tm_create(4 * sizeof(Int), sizeof(Int));
+  CHECK(shared != invalid_shared);
+  auto* x = static_cast<Int*>(tm_start(shared));
+
+  auto tx = tm_begin(shared, false);
+  Int value = std::numeric_limits<Int>::max() - 1;
+  CHECK(tm_write(shared, tx, &value, sizeof(value), x));
+  CHECK(tm_end(shared, tx));
+  tx = tm_begin(shared, false);
+  CHECK(!(tm_add(shared, tx, x, 2, NO_MIN, NO_MAX) && tm_end(shared, tx)));
+  tx = tm_begin(shared, false);
+  CHECK(tm_add(shared, tx, x, 1, NO_MIN, NO_MAX) && tm_end(shared, tx));
+
+  tx = tm_begin(shared, false);
+  CHECK(tm_add(shared, tx, x + 1, -1, NO_MIN, NO_MAX) && tm_end(shared, tx));
+  tx = tm_begin(shared, false);
+  CHECK(tm_add(shared, tx, x + 1, 3, NO_MIN, NO_MAX) && tm_end(shared, tx));
+
+  tx = tm_begin(shared, true);
+  Int values[2];
+  CHECK(tm_read(shared, tx, x, sizeof(values), values));
+  CHECK(tm_end(shared, tx));
+  CHECK(values[0] == std::numeric_limits<Int>::max());
+  CHECK(values[1] == 2);
+  tm_destroy(shared);
+}
+
+// Words wider than 8 bytes can't be added to: the transaction is aborted
+static void unsupported() {
+  constexpr std::size_t align = 16;
+  auto shared = tm_create(4 * align, align);
+  CHECK(shared != invalid_shared);
+  auto* x = static_cast<char*>(tm_start(shared));
+
+  auto tx = tm_begin(shared, false);
+  CHECK(!tm_add(shared, tx, x, 1, NO_MIN, NO_MAX));
+  // Nothing it did before is committed
+  char value[align] = {1};
+  tx = tm_begin(shared, false);
+  CHECK(tm_write(shared, tx, value, align, x + align));
+  CHECK(!tm_add(shared, tx, x, 1, NO_MIN, NO_MAX));
+  tx = tm_begin(shared, true);
+  CHECK(tm_read(shared, tx, x + align, align, value));
+  CHECK(tm_end(shared, tx));
+  CHECK(value[0] == 0);
+  tm_destroy(shared);
+}
+
+int main() {
+  auto shared = tm_create(4 * sizeof(std::uint64_t), sizeof(std::uint64_t));
+  CHECK(shared != invalid_shared);
+  commutes(shared);
+  bounded(shared);
+  tm_destroy(shared);
+  sized<std::int8_t>();
+  sized<std::int16_t>();
+  sized<std::int32_t>();
+  sized<std::int64_t>();
+  unsupported();
+  return 0;
+}
@@ -0,0 +1,162 @@
+// Closed nested scopes: tm_begin_nested and tm_end_nested
+
+#include "check.hpp"
+
+// Word of the region, read in a transaction
+static std::uint64_t read(shared_t shared, tx_t tx, std::uint64_t* addr) {
+  std::uint64_t value = ~std::uint64_t{0};
+  CHECK(tm_read(shared, tx, addr, sizeof(value), &value));
+  return value;
+}
+
+static void write(shared_t shared, tx_t tx, std::uint64_t* addr,
+                  std::uint64_t value) {
+  CHECK(tm_write(shared, tx, &value, sizeof(value), addr));
+}
+
+// A scope that ends normally is merged into its transaction
+static void merges(shared_t shared) {
+  auto* a = word(shared, 0);
+  auto* b = word(shared, 1);
+  auto tx = tm_begin(shared, false);
+  write(shared, tx, a, 1);
+  tm_begin_nested(shared, tx);
+  write(shared, tx, b, 2);
+  CHECK(read(shared, tx, a) == 1);
+  CHECK(tm_end_nested(shared, tx) == Scope::committed);
+  CHECK(read(shared, tx, b) == 2);
+  CHECK(tm_end(shared, tx));
+  CHECK(load(shared, a) == 1);
+  CHECK(load(shared, b) == 2);
+}
+
+// A conflict inside a scope rolls back its writes only, and the scope can be
+// run again
+static void rolls_back(shared_t shared) {
+  auto* a = word(shared, 2);
+  auto* b = word(shared, 3);
+  auto* w = word(shared, 4);
+  auto* z = word(shared, 5);
+  store(shared, b, 10);
+
+  auto tx = tm_begin(shared, false);
+  write(shared, tx, a, 1);
+  tm_begin_nested(shared, tx);
+  write(shared, tx, b, 7);
+  CHECK(read(shared, tx, w) == 0);
+  // Commits to a word the scope read and to one it reads next
+  auto other = tm_begin(shared, false);
+  write(shared, other, w, 20);
+  write(shared, other, z, 30);
+  CHECK(tm_end(shared, other));
+  std::uint64_t value;
+  CHECK(!tm_read(shared, tx, z, sizeof(value), &value));
+  CHECK(tm_end_nested(shared, tx) == Scope::retry);
+
+  // Back to the savepoint: the outer write stays, the scope's is gone
+  CHECK(read(shared, tx, a) == 1);
+  CHECK(read(shared, tx, b) == 10);
+  tm_begin_nested(shared, tx);
+  CHECK(read(shared, tx, w) == 20);
+  CHECK(read(shared, tx, z) == 30);
+  write(shared, tx, b, 8);
+  CHECK(tm_end_nested(shared, tx) == Scope::committed);
+  CHECK(tm_end(shared, tx));
+
+  CHECK(load(shared, a) == 1);
+  CHECK(load(shared, b) == 8);
+}
+
+// A scope can't fix a conflict on what the transaction read before it
+static void aborts(shared_t shared) {
+  auto* c = word(shared, 6);
+  auto* z = word(shared, 7);
+  auto* d = word(shared, 8);
+
+  auto tx = tm_begin(shared, false);
+  CHECK(read(shared, tx, c) == 0);
+  write(shared, tx, d, 1);
+  tm_begin_nested(shared, tx);
+  auto other = tm_begin(shared, false);
+  write(shared, other, c, 1);
+  write(shared, other, z, 1);
+  CHECK(tm_end(shared, other));
+  std::uint64_t value;
+  CHECK(!tm_read(shared, tx, z, sizeof(value), &value));
+  // The transaction's handle is freed
+  CHECK(tm_end_nested(shared, tx) == Scope::aborted);
+  CHECK(load(shared, d) == 0);
+}
+
+// An inner scope rolls back to its own savepoint, keeping what the enclosing
+// scope wrote
+static void inner_rolls_back(shared_t shared) {
+  auto* b = word(shared, 9);
+  auto* d = word(shared, 10);
+  auto* w = word(shared, 11);
+  auto* z = word(shared, 12);
+
+  auto tx = tm_begin(shared, false);
+  tm_begin_nested(shared, tx);
+  write(shared, tx, b, 1);
+  tm_begin_nested(shared, tx);
+  write(shared, tx, d, 2);
+  CHECK(read(shared, tx, w) == 0);
+  auto other = tm_begin(shared, false);
+  write(shared, other, w, 3);
+  write(shared, other, z, 4);
+  CHECK(tm_end(shared, other));
+  std::uint64_t value;
+  CHECK(!tm_read(shared, tx, z, sizeof(value), &value));
+  CHECK(tm_end_nested(shared, tx) == Scope::retry);
+
+  CHECK(read(shared, tx, b) == 1);
+  CHECK(read(shared, tx, d) == 0);
+  tm_begin_nested(shared, tx);
+  write(shared, tx, d, read(shared, tx, z));
+  CHECK(tm_end_nested(shared, tx) == Scope::committed);
+  CHECK(tm_end_nested(shared, tx) == Scope::committed);
+  CHECK(tm_end(shared, tx));
+
+  CHECK(load(shared, b) == 1);
+  CHECK(load(shared, d) == 4);
+}
+
+// Segments allocated in a rolled back scope are gone, freed ones are back
+static void segments(shared_t shared) {
+  auto* w = word(shared, 13);
+  auto* z = word(shared, 14);
+  void* kept;
+  auto tx = tm_begin(shared, false);
+  CHECK(tm_alloc(shared, tx, 64, &kept) == Alloc::success);
+  CHECK(tm_end(shared, tx));
+
+  tx = tm_begin(shared, false);
+  tm_begin_nested(shared, tx);
+  void* dropped;
+  CHECK(tm_alloc(shared, tx, 64, &dropped) == Alloc::success);
+  CHECK(tm_free(shared, tx, kept));
+  CHECK(read(shared, tx, w) == 0);
+  auto other = tm_begin(shared, false);
+  write(shared, other, w, 1);
+  write(shared, other, z, 1);
+  CHECK(tm_end(shared, other));
+  std::uint64_t value;
+  CHECK(!tm_read(shared, tx, z, sizeof(value), &value));
+  CHECK(tm_end_nested(shared, tx) == Scope::retry);
+  write(shared, tx, static_cast<std::uint64_t*>(kept), 5);
+  CHECK(tm_end(shared, tx));
+  CHECK(load(shared, static_cast<std::uint64_t*>(kept)) == 5);
+}
+
+int main() {
+  auto shared = tm_create(16 * sizeof(std::uint64_t), sizeof(std::uint64_t));
+  CHECK(shared != invalid_shared);
+  merges(shared);
+  rolls_back(shared);
+  aborts(shared);
+  inner_rolls_back(shared);
+  segments(shared);
+  tm_destroy(shared);
+  return 0;
+}
@@ -0,0 +1,116 @@
+// Read views: tm_read_view
+
+#include "check.hpp"
+
+constexpr std::size_t PAGE = 4096;
+constexpr std::size_t PAGE_WORDS = PAGE / sizeof(std::uint64_t);
+
+static const std::uint64_t* view(shared_t shared, tx_t tx,
+                                 const std::uint64_t* addr, std::size_t words) {
+  auto* range = tm_read_view(shared, tx, addr, words * sizeof(*addr));
+  CHECK(range != nullptr);
+  return static_cast<const std::uint64_t*>(range);
+}
+
+// Sets `words` words from `addr` on to `first`, `first + 1`, ...
+static void fill(shared_t shared, std::uint64_t* addr, std::size_t words,
+                 std::uint64_t first) {
+  auto tx = tm_begin(shared, false);
+  for (std::size_t i = 0; i < words; ++i) {
+    auto value = first + i;
+    CHECK(tm_write(shared, tx, &value, sizeof(value), addr + i));
+  }
+  CHECK(tm_end(shared, tx));
+}
+
+static bool holds(const std::uint64_t* range, std::size_t words,
+                  std::uint64_t first) {
+  for (std::size_t i = 0; i < words; ++i) {
+    if (range[i] != first + i) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// A read-only transaction's views show its snapshot until it ends, whatever
+// commits in the meantime
+static void stable(shared_t shared, std::uint64_t* addr, std::size_t words) {
+  fill(shared, addr, words, 100);
+  auto tx = tm_begin(shared, true);
+  auto* one = view(shared, tx, addr, 1);
+  auto* all = view(shared, tx, addr, words);
+  CHECK(*one == 100);
+  CHECK(holds(all, words, 100));
+
+  fill(shared, addr, words, 200);
+  CHECK(*one == 100);
+  CHECK(holds(all, words, 100));
+  if (!norec()) {
+    // Later views still come from the same snapshot
+    CHECK(holds(view(shared, tx, addr + 1, words - 1), words - 1, 101));
+  }
+  CHECK(tm_end(shared, tx));
+}
+
+// A read-write transaction's views show its own writes, and a conflict ends
+// it like a failed tm_read
+static void read_write(shared_t shared, std::uint64_t* addr) {
+  fill(shared, addr, 4, 0);
+  auto tx = tm_begin(shared, false);
+  std::uint64_t value = 7;
+  CHECK(tm_write(shared, tx, &value, sizeof(value), addr + 1));
+  CHECK(holds(view(shared, tx, addr, 2), 1, 0));
+  CHECK(view(shared, tx, addr, 2)[1] == 7);
+
+  fill(shared, addr + 2, 2, 10);
+  if (norec()) {
+    // Nothing it read changed: it moves on to the new snapshot
+    CHECK(holds(view(shared, tx, addr + 2, 2), 2, 10));
+    CHECK(tm_end(shared, tx));
+    return;
+  }
+  CHECK(tm_read_view(shared, tx, addr + 2, 2 * sizeof(value)) == nullptr);
+}
+
+// Views taken all along a transaction each keep their own contents
+static void many(shared_t shared, std::uint64_t* addr, std::size_t words) {
+  fill(shared, addr, words, 0);
+  for (bool is_ro : {true, false}) {
+    auto tx = tm_begin(shared, is_ro);
+    const std::uint64_t* views[1000];
+    for (std::size_t i = 0; i < 1000; ++i) {
+      views[i] = view(shared, tx, addr + i % (words - 8), 8);
+    }
+    for (std::size_t i = 0; i < 1000; ++i) {
+      CHECK(holds(views[i], 8, i % (words - 8)));
+    }
+    CHECK(tm_end(shared, tx));
+  }
+}
+
+int main() {
+  auto shared =
+      tm_create(4 * PAGE_WORDS * sizeof(std::uint64_t), sizeof(std::uint64_t));
+  CHECK(shared != invalid_shared);
+  stable(shared, word(shared, 0), 16);
+  read_write(shared, word(shared, 16));
+  many(shared, word(shared, 0), 64);
+  tm_destroy(shared);
+
+  // Segments kept per page: views within a page point at the page, others
+  // are copied across pages
+  setenv("TM_PAGE_SEGMENTS", "4096", 1);
+  shared = tm_create(PAGE, sizeof(std::uint64_t));
+  CHECK(shared != invalid_shared);
+  void* segment;
+  auto tx = tm_begin(shared, false);
+  CHECK(tm_alloc(shared, tx, 4 * PAGE, &segment) == Alloc::success);
+  CHECK(tm_end(shared, tx));
+  auto* paged = static_cast<std::uint64_t*>(segment);
+  stable(shared, paged, PAGE_WORDS);
+  stable(shared, paged + PAGE_WORDS / 2, PAGE_WORDS * 2);
+  many(shared, paged + PAGE_WORDS - 32, 64);
+  tm_destroy(shared);
+  return 0;
+}
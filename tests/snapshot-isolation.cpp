@@ -0,0 +1,91 @@
+// Snapshot isolation: tm_begin_si. NOrec runs these transactions as
+// serializable ones, which it's allowed to.
+
+#include "check.hpp"
+
+static bool read(shared_t shared, tx_t tx, std::uint64_t* addr,
+                 std::uint64_t& value) {
+  return tm_read(shared, tx, addr, sizeof(value), &value);
+}
+
+static bool write(shared_t shared, tx_t tx, std::uint64_t* addr,
+                  std::uint64_t value) {
+  return tm_write(shared, tx, &value, sizeof(value), addr);
+}
+
+// Reads come from the snapshot the transaction started on, and see its own
+// writes
+static void reads_snapshot(shared_t shared) {
+  auto* x = word(shared, 0);
+  auto* y = word(shared, 1);
+  auto* z = word(shared, 2);
+  store(shared, x, 1);
+  store(shared, y, 1);
+
+  auto tx = tm_begin_si(shared);
+  std::uint64_t value;
+  CHECK(read(shared, tx, x, value) && value == 1);
+  store(shared, x, 2);
+  store(shared, y, 2);
+  if (norec()) {
+    // A serializable transaction can't go on from a value that changed
+    CHECK(!read(shared, tx, y, value));
+    return;
+  }
+  CHECK(read(shared, tx, x, value) && value == 1);
+  CHECK(read(shared, tx, y, value) && value == 1);
+  CHECK(write(shared, tx, z, 3));
+  CHECK(read(shared, tx, z, value) && value == 3);
+  CHECK(tm_end(shared, tx));
+  CHECK(load(shared, x) == 2);
+  CHECK(load(shared, z) == 3);
+}
+
+// Of two transactions writing the same word, the first to commit wins
+static void first_committer_wins(shared_t shared) {
+  auto* x = word(shared, 3);
+  auto tx = tm_begin_si(shared);
+  std::uint64_t value;
+  CHECK(read(shared, tx, x, value) && value == 0);
+  store(shared, x, 1);
+  CHECK(!(write(shared, tx, x, value + 1) && tm_end(shared, tx)));
+  CHECK(load(shared, x) == 1);
+}
+
+// Both transactions keep x + y >= 1 on their own snapshot, but write
+// different words: under snapshot isolation both commit, and the invariant
+// breaks
+static void write_skew(shared_t shared, bool snapshot_isolation) {
+  auto* x = word(shared, 4);
+  auto* y = word(shared, 5);
+  store(shared, x, 1);
+  store(shared, y, 1);
+
+  auto begin = [&] {
+    return snapshot_isolation ? tm_begin_si(shared) : tm_begin(shared, false);
+  };
+  auto first = begin();
+  auto second = begin();
+  std::uint64_t x1, y1, x2, y2;
+  CHECK(read(shared, first, x, x1) && read(shared, first, y, y1));
+  CHECK(read(shared, second, x, x2) && read(shared, second, y, y2));
+  CHECK(x1 + y1 == 2 && x2 + y2 == 2);
+  CHECK(write(shared, first, x, 0));
+  CHECK(tm_end(shared, first));
+  bool skewed = write(shared, second, y, 0) && tm_end(shared, second);
+
+  CHECK(skewed == (snapshot_isolation && !norec()));
+  CHECK(load(shared, x) == 0);
+  CHECK(load(shared, y) == (skewed ? 0 : 1));
+}
+
+int main() {
+  auto shared = tm_create(8 * sizeof(std::uint64_t), sizeof(std::uint64_t));
+  CHECK(shared != invalid_shared);
+  reads_snapshot(shared);
+  first_committer_wins(shared);
+  write_skew(shared, true);
+  write_skew(shared, false);
+  tm_destroy(shared);
+  return 0;
+}
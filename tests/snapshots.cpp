@@ -0,0 +1,138 @@
+// Exported snapshots: tm_export_snapshot, tm_begin_snapshot and
+// tm_release_snapshot
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "check.hpp"
+
+constexpr std::size_t WORDS = 64;
+
+static std::uint64_t read(shared_t shared, tx_t tx, const std::uint64_t* addr) {
+  std::uint64_t value;
+  CHECK(tm_read(shared, tx, addr, sizeof(value), &value));
+  return value;
+}
+
+// Only read-only transactions share their snapshot, and only with versions
+// to read it from
+static bool unsupported(shared_t shared) {
+  auto tx = tm_begin(shared, false);
+  CHECK(tm_export_snapshot(shared, tx) == invalid_snapshot);
+  CHECK(tm_end(shared, tx));
+  CHECK(tm_begin_snapshot(shared, invalid_snapshot) == invalid_tx);
+  tm_release_snapshot(shared, invalid_snapshot);
+
+  tx = tm_begin(shared, true);
+  auto snapshot = tm_export_snapshot(shared, tx);
+  CHECK(tm_end(shared, tx));
+  CHECK((snapshot == invalid_snapshot) == norec());
+  tm_release_snapshot(shared, snapshot);
+  return norec();
+}
+
+// The snapshot outlives its transaction, through many later commits
+static void outlives(shared_t shared) {
+  auto* x = word(shared, 0);
+  store(shared, x, 1);
+  auto tx = tm_begin(shared, true);
+  CHECK(read(shared, tx, x) == 1);
+  auto snapshot = tm_export_snapshot(shared, tx);
+  CHECK(snapshot != invalid_snapshot);
+  CHECK(tm_end(shared, tx));
+
+  for (std::uint64_t i = 2; i < 1000; ++i) {
+    store(shared, x, i);
+  }
+  std::uint64_t seen = 0;
+  std::thread reader([&] {
+    auto tx = tm_begin_snapshot(shared, snapshot);
+    CHECK(tx != invalid_tx);
+    seen = read(shared, tx, x);
+    CHECK(tm_end(shared, tx));
+  });
+  reader.join();
+  CHECK(seen == 1);
+
+  // Transactions begun from it keep reading it once it's released
+  tx = tm_begin_snapshot(shared, snapshot);
+  tm_release_snapshot(shared, snapshot);
+  for (std::uint64_t i = 0; i < 1000; ++i) {
+    store(shared, x, i);
+  }
+  CHECK(read(shared, tx, x) == 1);
+  CHECK(tm_end(shared, tx));
+}
+
+// Threads scanning disjoint halves of the region from one snapshot see the
+// same state, while a writer keeps moving amounts between words
+static void parallel_scan(shared_t shared) {
+  // Words only ever move amounts around, wrapping around included
+  std::uint64_t total = 0;
+  auto tx = tm_begin(shared, true);
+  for (std::size_t i = 0; i < WORDS; ++i) {
+    total += read(shared, tx, word(shared, i));
+  }
+  CHECK(tm_end(shared, tx));
+
+  std::atomic_bool done{false};
+  std::thread writer([&] {
+    for (std::uint64_t i = 0; !done.load(); ++i) {
+      auto* from = word(shared, i % WORDS);
+      auto* to = word(shared, (i * 7 + 3) % WORDS);
+      if (from == to) {
+        continue;
+      }
+      auto tx = tm_begin(shared, false);
+      std::uint64_t a, b;
+      if (!tm_read(shared, tx, from, sizeof(a), &a) ||
+          !tm_read(shared, tx, to, sizeof(b), &b)) {
+        continue;
+      }
+      a -= 1;
+      b += 1;
+      if (tm_write(shared, tx, &a, sizeof(a), from) &&
+          tm_write(shared, tx, &b, sizeof(b), to)) {
+        tm_end(shared, tx);
+      }
+    }
+  });
+
+  for (int round = 0; round < 100; ++round) {
+    tx = tm_begin(shared, true);
+    auto snapshot = tm_export_snapshot(shared, tx);
+    CHECK(snapshot != invalid_snapshot);
+    std::uint64_t sums[2] = {0, 0};
+    std::vector<std::thread> scanners;
+    for (std::size_t half = 0; half < 2; ++half) {
+      scanners.emplace_back([&, half] {
+        auto tx = tm_begin_snapshot(shared, snapshot);
+        for (std::size_t i = half * WORDS / 2; i < (half + 1) * WORDS / 2;
+             ++i) {
+          sums[half] += read(shared, tx, word(shared, i));
+        }
+        CHECK(tm_end(shared, tx));
+      });
+    }
+    for (auto& scanner : scanners) {
+      scanner.join();
+    }
+    tm_release_snapshot(shared, snapshot);
+    CHECK(tm_end(shared, tx));
+    CHECK(sums[0] + sums[1] == total);
+  }
+  done.store(true);
+  writer.join();
+}
+
+int main() {
+  auto shared = tm_create(WORDS * sizeof(std::uint64_t), sizeof(std::uint64_t));
+  CHECK(shared != invalid_shared);
+  if (!unsupported(shared)) {
+    outlives(shared);
+    parallel_scan(shared);
+  }
+  tm_destroy(shared);
+  return 0;
+}